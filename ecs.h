@@ -2,28 +2,62 @@
 #define ECS_H
 
 #include <cstdint>
+#include <cstddef>
+#include <typeinfo>
 #include <utility>
 #include <vector>
 #include <queue>
-#include <set>
 #include <unordered_set>
+#include <unordered_map>
 #include <algorithm>
 #include <map>
+#include <numeric>
+#include <tuple>
+#include <memory>
+#include <type_traits>
+#include <iterator>
+#include <string>
 #include <functional>
 #include <limits>
 #include <cassert>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <array>
+#include <cmath>
+#include <chrono>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define ECS_COROUTINES
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ECS_X86_SIMD
+#include <immintrin.h>
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace ecs {
 
 typedef uint16_t ComponentType;
 typedef size_t Entity;
+typedef uint64_t Tick;
 
 template <class T>
 class _Component {
 public:	
 	static ComponentType type() { return T::m_type; }
 	
-	Entity id() { return m_id; }
+	Entity id() const { return m_id; }
 
 	void setId(Entity id) { m_id = id; }
 	
@@ -64,316 +98,3936 @@ ComponentType registerComponent() {
 template <class T>
 const ComponentType _Component<T>::m_type = registerComponent<T>();
 
-class BaseContainer {
+// one bit per entity id, used for membership tests and bitwise query evaluation
+class EntityBitmap {
 public:
-	virtual ~BaseContainer() = default;	
+	void set(Entity id)
+	{
+		if (m_words.size() <= (id >> 6))
+			m_words.resize((id >> 6) + 1, 0);
+		
+		m_words[id >> 6] |= uint64_t(1) << (id & 63);
+	}
 	
-	virtual size_t size() = 0;
-	virtual void clear() = 0;
-	virtual std::pair<size_t, size_t> remove(size_t index) = 0;
+	void reset(Entity id)
+	{
+		if ((id >> 6) < m_words.size())
+			m_words[id >> 6] &= ~(uint64_t(1) << (id & 63));
+	}
+	
+	bool test(Entity id) const
+	{
+		return (id >> 6) < m_words.size() && (m_words[id >> 6] >> (id & 63)) & 1;
+	}
+	
+	size_t words() const { return m_words.size(); }
+	
+	const uint64_t* data() const { return m_words.data(); }
+	
+	void clear() { m_words.clear(); }
+	
+private:
+	std::vector<uint64_t> m_words;
 };
 
-template<class T>
-class Container : public BaseContainer {
-public:	
-	Container() { m_items.resize(1); }
+inline unsigned countTrailingZeros(uint64_t word)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(word);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return index;
+#else
+	unsigned count = 0;
 	
-	size_t size() override { return m_items.size(); }
+	while (!(word & 1)) {
+		word >>= 1;
+		++count;
+	}
+	
+	return count;
+#endif
+}
 
-	T& itemAt(size_t index) { return m_items[index]; }
+// out[i] = all[0][offset + i] & ... & ~none[0][offset + i] & ..., for i < count
+typedef void (*IntersectFunction)(const uint64_t *const *all, size_t allCount, 
+	const uint64_t *const *none, size_t noneCount, size_t offset, size_t count, uint64_t *out);
+
+inline void intersectScalar(const uint64_t *const *all, size_t allCount, 
+	const uint64_t *const *none, size_t noneCount, size_t offset, size_t count, uint64_t *out)
+{
+	for (size_t i = offset; i < offset + count; ++i) {
+		uint64_t word = all[0][i];
+		
+		for (size_t k = 1; k < allCount; ++k)
+			word &= all[k][i];
+		
+		for (size_t k = 0; k < noneCount; ++k)
+			word &= ~none[k][i];
+		
+		*out++ = word;
+	}
+}
+
+#ifdef ECS_X86_SIMD
+__attribute__((target("sse2")))
+inline void intersectSSE2(const uint64_t *const *all, size_t allCount, 
+	const uint64_t *const *none, size_t noneCount, size_t offset, size_t count, uint64_t *out)
+{
+	size_t i = 0;
 	
-	T& operator[](size_t index) { return m_items[index]; }
+	for (; i + 2 <= count; i += 2) {
+		__m128i word = _mm_loadu_si128(reinterpret_cast<const __m128i*>(all[0] + offset + i));
+		
+		for (size_t k = 1; k < allCount; ++k)
+			word = _mm_and_si128(word, _mm_loadu_si128(reinterpret_cast<const __m128i*>(all[k] + offset + i)));
+		
+		for (size_t k = 0; k < noneCount; ++k)
+			word = _mm_andnot_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(none[k] + offset + i)), word);
+		
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), word);
+	}
 	
-	std::vector<T>& items() { return m_items; }
+	intersectScalar(all, allCount, none, noneCount, offset + i, count - i, out + i);
+}
+
+__attribute__((target("avx2")))
+inline void intersectAVX2(const uint64_t *const *all, size_t allCount, 
+	const uint64_t *const *none, size_t noneCount, size_t offset, size_t count, uint64_t *out)
+{
+	size_t i = 0;
 	
-	size_t insert(const T &item)
+	for (; i + 4 <= count; i += 4) {
+		__m256i word = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(all[0] + offset + i));
+		
+		for (size_t k = 1; k < allCount; ++k)
+			word = _mm256_and_si256(word, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(all[k] + offset + i)));
+		
+		for (size_t k = 0; k < noneCount; ++k)
+			word = _mm256_andnot_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(none[k] + offset + i)), word);
+		
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), word);
+	}
+	
+	intersectScalar(all, allCount, none, noneCount, offset + i, count - i, out + i);
+}
+#endif
+
+// widest implementation supported by the running cpu, resolved once
+inline IntersectFunction intersectFunction()
+{
+	static const IntersectFunction function = [] {
+#ifdef ECS_X86_SIMD
+		if (__builtin_cpu_supports("avx2"))
+			return intersectAVX2;
+		
+		if (__builtin_cpu_supports("sse2"))
+			return intersectSSE2;
+#endif
+		return intersectScalar;
+	}();
+	
+	return function;
+}
+
+// first index at or after from whose value is not less than value in a sorted list,
+// exponential steps then a binary search, cheap when the answer is close
+inline size_t gallop(const std::vector<Entity> &list, size_t from, Entity value)
+{
+	size_t high = from;
+	
+	for (size_t step = 1; high < list.size() && list[high] < value; step <<= 1) {
+		from = high + 1;
+		high += step;
+	}
+	
+	return std::lower_bound(list.begin() + from, list.begin() + std::min(high, list.size()), value) - list.begin();
+}
+
+// bounded Chase-Lev deque: the owning worker pushes and pops at the bottom, 
+// other threads steal from the top with a compare and swap
+template <class T>
+class WorkQueue {
+public:
+	WorkQueue()
 	{
-		m_items.push_back(item);
+		for (std::atomic<T*> &slot : m_slots)
+			slot.store(nullptr, std::memory_order_relaxed);
+	}
+	
+	// owner only, false when full
+	bool push(T *item)
+	{
+		int64_t bottom = m_bottom.load(std::memory_order_relaxed);
 		
-		return m_items.size() - 1;
+		if (bottom - m_top.load() >= int64_t(Capacity))
+			return false;
+		
+		m_slots[bottom & (Capacity - 1)].store(item, std::memory_order_relaxed);
+		m_bottom.store(bottom + 1);
+		
+		return true;
 	}
 	
-	std::pair<size_t, size_t> remove(size_t index) override
+	// owner only, newest item first
+	T* pop()
 	{
-		if (index < m_items.size() - 1) {
-			std::swap(m_items[index], m_items[m_items.size() - 1]);
-			m_items.pop_back();
+		int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+		m_bottom.store(bottom);
+		int64_t top = m_top.load();
+		
+		if (top > bottom) {
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		
+		T *item = m_slots[bottom & (Capacity - 1)].load(std::memory_order_relaxed);
+		
+		// last item, race the thieves for it
+		if (top == bottom) {
+			if (!m_top.compare_exchange_strong(top, top + 1))
+				item = nullptr;
 			
-			return std::make_pair(m_items[index].id(), index);
-		} else {
-			m_items.pop_back();
-
-			return std::make_pair(0, 0);
+			m_bottom.store(bottom + 1, std::memory_order_relaxed);
 		}
+		
+		return item;
 	}
 	
-	void clear() override { m_items.resize(1); }
+	// any thread, oldest item first, null when empty or lost to another thread
+	T* steal()
+	{
+		int64_t top = m_top.load();
+		int64_t bottom = m_bottom.load();
+		
+		if (top >= bottom)
+			return nullptr;
+		
+		T *item = m_slots[top & (Capacity - 1)].load(std::memory_order_relaxed);
+		
+		return m_top.compare_exchange_strong(top, top + 1) ? item : nullptr;
+	}
 	
 private:
-	std::vector<T> m_items;
+	static constexpr size_t Capacity = 4096;
+	
+	alignas(64) std::atomic<int64_t> m_top{0};
+	alignas(64) std::atomic<int64_t> m_bottom{0};
+	std::atomic<T*> m_slots[Capacity];
 };
 
-template<class T>
-class SparseContainer {
+// work-stealing pool: every worker splits its ranges into a deque of its own and idle workers 
+// steal the largest halves left, threads waiting on a job run other tasks meanwhile so nested 
+// parallelFor calls from inside tasks cannot deadlock, callers outside the pool take part too
+class ThreadPool {
 public:
-	SparseContainer() { m_items.resize(1); }
-	
-	size_t realSize() { return m_items.size(); }
-	
-	size_t size() { return m_items.size() - m_free.size(); }
+	// workers are pinned to consecutive cpus after the first one, left to the calling thread
+	explicit ThreadPool(size_t threads = std::max(std::thread::hardware_concurrency(), 1u), bool pin = true)
+	{
+		for (size_t i = 1; i < threads; ++i)
+			m_workers.push_back(std::make_unique<Worker>());
+		
+		for (size_t i = 0; i < m_workers.size(); ++i) {
+			m_workers[i]->thread = std::thread([this, i] { work(i); });
+			
+			if (pin)
+				pinThread(m_workers[i]->thread, i + 1);
+		}
+	}
 	
-	T& itemAt(size_t index) { return m_items[index]; }
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		
+		m_condition.notify_all();
+		
+		for (std::unique_ptr<Worker> &worker : m_workers)
+			worker->thread.join();
+	}
 	
-	T& operator[](size_t index) { return m_items[index]; }
+	// process wide pool sized to the hardware, share it rather than creating pools per subsystem
+	static ThreadPool& shared()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
 	
-	std::vector<T>& data() { return m_items; }
+	// threads running parallelFor ranges, including the caller
+	size_t size() const { return m_workers.size() + 1; }
 	
-	size_t insert(const T &item)
+	// call fn(rangeBegin, rangeEnd) over [begin, end) and return once every range is done,
+	// ranges are grain items, by default multiples of 64 with a few ranges per thread for load balancing
+	template <class Function>
+	void parallelFor(size_t begin, size_t end, Function fn, size_t grain = 0)
 	{
-		size_t itemIndex;
+		if (end <= begin)
+			return;
 		
-		if (!m_free.empty()) {
-			itemIndex = m_free.front();
-			m_free.pop();
-			m_items[itemIndex] = item;
+		size_t count = end - begin;
+		
+		if (grain == 0)
+			grain = (std::max<size_t>(1024, count / (size() * 4)) + 63) & ~size_t(63);
+		
+		if (m_workers.empty() || count <= grain) {
+			fn(begin, end);
+			return;
+		}
+		
+		size_t ranges = (count + grain - 1) / grain;
+		
+		Job job(count, grain, ranges);
+		job.run = [&fn](size_t rangeBegin, size_t rangeEnd) { fn(rangeBegin, rangeEnd); };
+		
+		if (Worker *self = currentWorker()) {
+			Task root = {&job, begin, end};
+			execute(self, &root);
 		} else {
-			itemIndex = m_items.size();
-			m_items.push_back(item);
+			// outside callers cannot be stolen from, hand every thread an even share up front,
+			// shares they take themselves are split back into the injection queue
+			size_t shares = std::min(ranges, size());
+			
+			for (size_t i = 0; i < shares; ++i)
+				submit(nullptr, job.allocate(begin + ranges * i / shares * grain, 
+					std::min(begin + ranges * (i + 1) / shares * grain, end)));
 		}
 		
-		return itemIndex;
+		wait(job);
 	}
 	
-	void remove(size_t index)
+	// run the nodes of a dependency graph, node i starts once dependencies[i] of its predecessors 
+	// are done, successors[i] lists the nodes waiting on i, fn(node) runs concurrently for ready nodes
+	template <class Function>
+	void graph(const std::vector<size_t> &dependencies, const std::vector<std::vector<size_t>> &successors, Function fn)
 	{
-		if (index < m_items.size() - 1) {
-			m_free.push(index);
-			m_items[index] = T();
-		} else {
-			m_items.pop_back();
+		size_t count = dependencies.size();
+		
+		if (count == 0)
+			return;
+		
+		std::unique_ptr<std::atomic<size_t>[]> pending(new std::atomic<size_t>[count]);
+		
+		for (size_t i = 0; i < count; ++i)
+			pending[i].store(dependencies[i], std::memory_order_relaxed);
+		
+		Job job(count, 0, count);
+		
+		// successors are queued before the node counts as done so the job cannot finish early
+		job.run = [this, &job, &fn, &pending, &successors](size_t node, size_t) {
+			fn(node);
+			
+			for (size_t next : successors[node]) {
+				if (--pending[next] == 0)
+					submit(currentWorker(), job.allocate(next, next + 1));
+			}
+		};
+		
+		Worker *self = currentWorker();
+		
+		for (size_t i = 0; i < count; ++i) {
+			if (dependencies[i] == 0)
+				submit(self, job.allocate(i, i + 1));
 		}
+		
+		wait(job);
 	}
 	
-	std::vector<T> &items() {return m_items;}
+private:
+	struct Job;
 	
-	void clear() { m_items.resize(1); }
+	struct Task {
+		Job *job;
+		size_t begin, end;
+	};
 	
-private:
-	std::vector<T> m_items;
-	std::queue<size_t> m_free;
-};
-
-class ComponentStorage {
-	public:
-		ComponentStorage() { m_storage.resize(ComponentRegister.size()); }
-		~ComponentStorage() { clear(); }
+	struct Job {
+		std::function<void(size_t, size_t)> run;
+		size_t grain; // ranges longer than this are split by the executing worker, 0 never splits
+		std::atomic<size_t> pending; // items not run yet
+		std::unique_ptr<Task[]> tasks;
+		std::atomic<size_t> allocated{0};
+		size_t capacity;
 		
-		BaseContainer* operator[](size_t index) { return m_storage[index]; }
-
-		template <typename T>
-		Container<T>* get()
-		{		
-			ComponentType type(T::type());
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool done = false;
 		
-			if (m_storage[type] == nullptr)
-				m_storage[type] = new Container<T>();
+		Job(size_t items, size_t grain, size_t capacity) 
+			: grain(grain), pending(items), tasks(new Task[capacity]), capacity(capacity) {}
 		
-			return static_cast<Container<T>*>(m_storage[type]);
+		// each task covers a distinct range, capacity bounds them, null if exceeded
+		Task* allocate(size_t begin, size_t end)
+		{
+			size_t index = allocated++;
+			
+			if (index >= capacity)
+				return nullptr;
+			
+			tasks[index] = {this, begin, end};
+			
+			return &tasks[index];
 		}
-
-		BaseContainer* get(ComponentType type)
-		{		
-			return m_storage[type];
+	};
+	
+	struct Worker {
+		WorkQueue<Task> queue;
+		uint64_t seed = 0;
+		std::thread thread;
+	};
+	
+	struct Context {
+		ThreadPool *pool = nullptr;
+		Worker *worker = nullptr;
+	};
+	
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::deque<Task*> m_injected; // tasks from threads outside the pool
+	std::atomic<size_t> m_injectedCount{0};
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::atomic<uint64_t> m_signal{0};
+	std::atomic<size_t> m_sleeping{0};
+	bool m_stop = false;
+	
+	static Context& context()
+	{
+		static thread_local Context context;
+		return context;
+	}
+	
+	Worker* currentWorker()
+	{
+		return context().pool == this ? context().worker : nullptr;
+	}
+	
+	static void pinThread(std::thread &thread, size_t cpu)
+	{
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu % std::max(std::thread::hardware_concurrency(), 1u), &set);
+		pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+		(void)thread;
+		(void)cpu;
+#endif
+	}
+	
+	// wake sleeping workers, paired with the epoch check in work()
+	void signal()
+	{
+		++m_signal;
+		
+		if (m_sleeping.load() > 0) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_condition.notify_all();
 		}
+	}
 	
-		void clear()
-		{
-			for(BaseContainer* b : m_storage)
-				delete b;
+	void submit(Worker *self, Task *task)
+	{
+		assert(task && "task capacity of the job exceeded");
 		
-			m_storage.clear();
+		if (!self || !self->queue.push(task)) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_injected.push_back(task);
+			++m_injectedCount;
 		}
+		
+		signal();
+	}
 	
-	private:
-		std::vector<BaseContainer*> m_storage;
-};
-
-typedef std::vector<size_t> ComponentList;
-typedef SparseContainer<ComponentList> EntityList;
-
-class ECS {
-	public:
-		ECS()
-		{
-			m_entitiesWith.resize(ComponentRegister.size());
+	Task* findTask(Worker *self)
+	{
+		if (self) {
+			if (Task *task = self->queue.pop())
+				return task;
 		}
 		
-		template <class T>
-		void addComponents(Entity id, T&& component)
-		{
-			ComponentType type(T::type());
-			
-			if (m_entities[id].size() <= type)
-				m_entities[id].resize(type + 1, 0);
-
-			component.setId(id);
-			size_t index = m_entities[id][type];
+		if (m_injectedCount.load() > 0) {
+			std::lock_guard<std::mutex> lock(m_mutex);
 			
-			if (index > 0) {
-				m_components.get<T>()->itemAt(index) = component;
-			}else {
-				m_entities[id][type] = m_components.get<T>()->insert(component);
+			if (!m_injected.empty()) {
+				Task *task = m_injected.front();
+				m_injected.pop_front();
+				--m_injectedCount;
 				
-				m_entitiesWith[type].insert(id);
+				return task;
 			}
 		}
 		
-		template <class T1, class T2, class ...Args>
-		void addComponents(Entity id, T1&&c1, T2&&c2, Args...args)
-		{
-			addComponents(id, c1);
-			addComponents(c2, args...);
-		}
-
-		template <class T, typename... Targs>
-		void createComponent(Entity id, Targs... args)
-		{
-			addComponents(id, T(args...));
-		}
-
-		template <class T>
-		void removeComponent(Entity id)
-		{
-			ComponentType type(T::type());
-
-			auto pair = m_components.get(type)->remove(componentIndex(id, type));
+		// xorshift picks the first victim so thieves spread over the workers
+		uint64_t seed = self ? self->seed : uint64_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
 		
-			if (pair.first > 0)
-				m_entities[pair.first][type] = pair.second;
-
-			m_entities[id][type] = 0;
+		if (self)
+			self->seed = seed;
+		
+		for (size_t i = 0; i < m_workers.size(); ++i) {
+			Worker *victim = m_workers[(seed + i) % m_workers.size()].get();
 			
-			m_entitiesWith[type].erase(id);
+			if (victim != self) {
+				if (Task *task = victim->queue.steal())
+					return task;
+			}
 		}
+		
+		return nullptr;
+	}
 	
-		template <class T>
-		const std::vector<T>& components()
-		{		
-			return m_components.get<T>()->items();
-		}
-
-		template <class T>
+	// halve the range down to the grain, workers push the large halves on their deque for thieves,
+	// outside threads have none and inject them
+	void execute(Worker *self, Task *task)
+	{
+		Job &job = *task->job;
+		size_t begin = task->begin, end = task->end;
+		
+		if (job.grain > 0) {
+			while (end - begin > job.grain) {
+				size_t middle = begin + (end - begin + job.grain - 1) / job.grain / 2 * job.grain;
+				Task *upper = job.allocate(middle, end);
+				
+				if (!upper || (self && !self->queue.push(upper)))
+					break;
+				
+				if (self)
+					signal();
+				else
+					submit(nullptr, upper);
+				
+				end = middle;
+			}
+		}
+		
+		job.run(begin, end);
+		
+		// the waiter leaves once done is set under the mutex, the job is not touched afterwards
+		if (job.pending.fetch_sub(end - begin) == end - begin) {
+			std::lock_guard<std::mutex> lock(job.mutex);
+			job.done = true;
+			job.condition.notify_all();
+		}
+	}
+	
+	// run any task while the job is in flight, outside threads sleep once nothing is left to take
+	void wait(Job &job)
+	{
+		Worker *self = currentWorker();
+		
+		while (job.pending.load() > 0) {
+			if (Task *task = findTask(self)) {
+				execute(self, task);
+			} else if (self) {
+				std::this_thread::yield();
+			} else {
+				std::unique_lock<std::mutex> lock(job.mutex);
+				job.condition.wait_for(lock, std::chrono::microseconds(100), [&job] { return job.done; });
+			}
+		}
+		
+		std::unique_lock<std::mutex> lock(job.mutex);
+		job.condition.wait(lock, [&job] { return job.done; });
+	}
+	
+	void work(size_t index)
+	{
+		Worker *self = m_workers[index].get();
+		self->seed = index * 0x9E3779B97F4A7C15ull + 1;
+		
+		context().pool = this;
+		context().worker = self;
+		
+		for (;;) {
+			uint64_t epoch = m_signal.load();
+			
+			if (Task *task = findTask(self)) {
+				execute(self, task);
+				continue;
+			}
+			
+			std::unique_lock<std::mutex> lock(m_mutex);
+			
+			if (m_stop)
+				return;
+			
+			++m_sleeping;
+			m_condition.wait(lock, [this, epoch] { return m_stop || m_signal.load() != epoch; });
+			--m_sleeping;
+		}
+	}
+};
+
+class BaseContainer {
+public:
+	virtual ~BaseContainer() = default;	
+	
+	virtual size_t size() = 0;
+	virtual const std::vector<Entity>& ids() = 0;
+	virtual const EntityBitmap& bitmap() = 0;
+	virtual void keepSorted(bool keep) = 0;
+	virtual bool sorted() = 0;
+	virtual const std::vector<Entity>& sortedIds() = 0;
+	virtual void* item(size_t index) = 0;
+	virtual void clear() = 0;
+	virtual std::pair<size_t, size_t> remove(size_t index) = 0;
+	virtual size_t clone(size_t index, const Entity *ids, size_t count, Tick tick) = 0;
+};
+
+template<class T>
+class Container : public BaseContainer {
+public:	
+	Container() 
+	{ 
+		m_items.resize(1); 
+		m_added.resize(1, 0);
+		m_changed.resize(1, 0);
+	}
+	
+	size_t size() override { return m_items.size(); }
+
+	T& itemAt(size_t index) { return m_items[index]; }
+	
+	void* item(size_t index) override { return &m_items[index]; }
+	
+	T& operator[](size_t index) { return m_items[index]; }
+	
+	std::vector<T>& items() { return m_items; }
+	
+	// owners of the components packed in slot order, without the dummy slot 0
+	const std::vector<Entity>& ids() override { return m_ids; }
+	
+	const EntityBitmap& bitmap() override { return m_bitmap; }
+	
+	// optional copy of the owners in ascending id order, inserts are appended and removals
+	// only mark it stale, the next sortedIds() restores it
+	void keepSorted(bool keep) override
+	{
+		m_keepSorted = keep;
+		m_sorted.clear();
+		m_sortedCount = 0;
+		m_sortedFresh.store(false, std::memory_order_relaxed);
+		
+		if (keep)
+			m_sorted = m_ids;
+		else
+			m_sorted.shrink_to_fit();
+	}
+	
+	bool sorted() override { return m_keepSorted; }
+	
+	// merges the appended tail, then drops the ids removed or re-added meanwhile, 
+	// once per batch of structural changes, concurrent readers wait for the first one
+	const std::vector<Entity>& sortedIds() override
+	{
+		if (!m_sortedFresh.load(std::memory_order_acquire)) {
+			std::lock_guard<std::mutex> lock(m_sortedMutex);
+			
+			if (!m_sortedFresh.load(std::memory_order_relaxed)) {
+				std::sort(m_sorted.begin() + m_sortedCount, m_sorted.end());
+				std::inplace_merge(m_sorted.begin(), m_sorted.begin() + m_sortedCount, m_sorted.end());
+				m_sorted.erase(std::unique(m_sorted.begin(), m_sorted.end()), m_sorted.end());
+				
+				if (m_sorted.size() != m_ids.size()) {
+					m_sorted.erase(std::remove_if(m_sorted.begin(), m_sorted.end(), 
+						[this](Entity id) { return !m_bitmap.test(id); }), m_sorted.end());
+				}
+				
+				m_sortedCount = m_sorted.size();
+				m_sortedFresh.store(true, std::memory_order_release);
+			}
+		}
+		
+		return m_sorted;
+	}
+	
+	// ticks at which the component in a slot was added and last changed
+	Tick addedTick(size_t index) const { return m_added[index]; }
+	
+	Tick changedTick(size_t index) const { return m_changed[index]; }
+	
+	void setChanged(size_t index, Tick tick) { m_changed[index] = tick; }
+	
+	// optional second copy of the items in the same slots, written while the first one is read
+	void buffer(bool enable)
+	{
+		m_buffered = enable;
+		m_next.clear();
+		
+		if (enable)
+			m_next = m_items;
+		else
+			m_next.shrink_to_fit();
+	}
+	
+	bool buffered() const { return m_buffered; }
+	
+	T& nextAt(size_t index) { return m_buffered ? m_next[index] : m_items[index]; }
+	
+	// the written copy becomes the read one, the old read copy is kept as is for the next writes
+	void swapBuffers() 
+	{ 
+		assert(m_buffered && "swapBuffers() on a component which is not double buffered");
+		
+		if (m_buffered)
+			m_items.swap(m_next); 
+	}
+	
+	// overwrite both copies, so the value survives the next swap
+	void assign(size_t index, const T &item)
+	{
+		m_items[index] = item;
+		
+		if (m_buffered)
+			m_next[index] = item;
+	}
+	
+	size_t insert(const T &item, Tick tick = 0)
+	{
+		m_items.push_back(item);
+		m_added.push_back(tick);
+		m_changed.push_back(tick);
+		m_ids.push_back(item.id());
+		m_bitmap.set(item.id());
+		
+		if (m_buffered)
+			m_next.push_back(item);
+		
+		if (m_keepSorted)
+			appendSorted(&m_ids.back(), 1);
+		
+		return m_items.size() - 1;
+	}
+	
+	// append count copies of item owned by ids, returns index of the first copy
+	size_t insert(const T &item, const Entity *ids, size_t count, Tick tick = 0)
+	{
+		size_t first = m_items.size();
+		
+		// single fill pass, lowered to block copies for trivially copyable types
+		m_items.insert(m_items.end(), count, item);
+		
+		for (size_t i = 0; i < count; ++i)
+			m_items[first + i].setId(ids[i]);
+		
+		m_added.insert(m_added.end(), count, tick);
+		m_changed.insert(m_changed.end(), count, tick);
+		m_ids.insert(m_ids.end(), ids, ids + count);
+		
+		for (size_t i = 0; i < count; ++i)
+			m_bitmap.set(ids[i]);
+		
+		if (m_buffered)
+			m_next.insert(m_next.end(), m_items.begin() + first, m_items.end());
+		
+		if (m_keepSorted)
+			appendSorted(ids, count);
+		
+		return first;
+	}
+	
+	size_t clone(size_t index, const Entity *ids, size_t count, Tick tick) override
+	{
+		T item = m_items[index];
+		
+		return insert(item, ids, count, tick);
+	}
+	
+	void swap(size_t index1, size_t index2)
+	{
+		std::swap(m_items[index1], m_items[index2]);
+		std::swap(m_added[index1], m_added[index2]);
+		std::swap(m_changed[index1], m_changed[index2]);
+		
+		if (m_buffered)
+			std::swap(m_next[index1], m_next[index2]);
+	}
+	
+	std::pair<size_t, size_t> remove(size_t index) override
+	{
+		m_bitmap.reset(m_ids[index - 1]);
+		
+		if (m_keepSorted)
+			m_sortedFresh.store(false, std::memory_order_relaxed);
+		
+		if (index < m_items.size() - 1) {
+			swap(index, m_items.size() - 1);
+			m_items.pop_back();
+			m_added.pop_back();
+			m_changed.pop_back();
+			
+			if (m_buffered)
+				m_next.pop_back();
+			
+			m_ids[index - 1] = m_ids.back();
+			m_ids.pop_back();
+			
+			return std::make_pair(m_items[index].id(), index);
+		} else {
+			m_items.pop_back();
+			m_added.pop_back();
+			m_changed.pop_back();
+			
+			if (m_buffered)
+				m_next.pop_back();
+			
+			m_ids.pop_back();
+
+			return std::make_pair(0, 0);
+		}
+	}
+	
+	// rebuild the owners list after the items were reordered
+	void refreshIds()
+	{
+		for (size_t i = 1; i < m_items.size(); ++i)
+			m_ids[i - 1] = m_items[i].id();
+	}
+	
+	void clear() override 
+	{ 
+		m_items.resize(1); 
+		m_next.resize(m_buffered ? 1 : 0);
+		m_added.resize(1);
+		m_changed.resize(1);
+		m_ids.clear();
+		m_sorted.clear();
+		m_sortedCount = 0;
+		m_sortedFresh.store(false, std::memory_order_relaxed);
+		m_bitmap.clear();
+	}
+	
+private:
+	std::vector<T> m_items;
+	std::vector<T> m_next;
+	bool m_buffered = false;
+	std::vector<Tick> m_added;
+	std::vector<Tick> m_changed;
+	std::vector<Entity> m_ids;
+	EntityBitmap m_bitmap;
+	std::vector<Entity> m_sorted;
+	size_t m_sortedCount = 0; // sorted prefix of m_sorted, may still hold removed ids
+	std::atomic<bool> m_sortedFresh{false};
+	std::mutex m_sortedMutex;
+	bool m_keepSorted = false;
+	
+	void appendSorted(const Entity *ids, size_t count)
+	{
+		// churn without merge joins starts over from the owners instead of growing the tail
+		if (m_sorted.size() + count > 2 * m_ids.size() + 64) {
+			m_sorted = m_ids;
+			m_sortedCount = 0;
+		} else {
+			m_sorted.insert(m_sorted.end(), ids, ids + count);
+		}
+		
+		m_sortedFresh.store(false, std::memory_order_relaxed);
+	}
+};
+
+template<class T>
+class SparseContainer {
+public:
+	SparseContainer() { m_items.resize(1); }
+	
+	size_t realSize() { return m_items.size(); }
+	
+	size_t size() { return m_items.size() - m_free.size(); }
+	
+	T& itemAt(size_t index) { return m_items[index]; }
+	
+	T& operator[](size_t index) { return m_items[index]; }
+	
+	std::vector<T>& data() { return m_items; }
+	
+	size_t insert(const T &item)
+	{
+		size_t itemIndex;
+		
+		if (!m_free.empty()) {
+			itemIndex = m_free.front();
+			m_free.pop();
+			m_items[itemIndex] = item;
+		} else {
+			itemIndex = m_items.size();
+			m_items.push_back(item);
+		}
+		
+		return itemIndex;
+	}
+	
+	void remove(size_t index)
+	{
+		if (index < m_items.size() - 1) {
+			m_free.push(index);
+			m_items[index] = T();
+		} else {
+			m_items.pop_back();
+		}
+	}
+	
+	std::vector<T> &items() {return m_items;}
+	
+	void clear() { m_items.resize(1); }
+	
+private:
+	std::vector<T> m_items;
+	std::queue<size_t> m_free;
+};
+
+class ComponentStorage {
+	public:
+		ComponentStorage() : m_storage(ComponentRegister.size()) {}
+		~ComponentStorage() { clear(); }
+		
+		BaseContainer* operator[](size_t index) { return get(index); }
+
+		// containers are created on first use, under a lock so concurrent readers may trigger it
+		template <typename T>
+		Container<T>* get()
+		{		
+			ComponentType type(T::type());
+			BaseContainer *container = m_storage[type].load(std::memory_order_acquire);
+		
+			if (container == nullptr) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				container = m_storage[type].load(std::memory_order_relaxed);
+				
+				if (container == nullptr) {
+					container = new Container<T>();
+					m_storage[type].store(container, std::memory_order_release);
+				}
+			}
+		
+			return static_cast<Container<T>*>(container);
+		}
+
+		BaseContainer* get(ComponentType type)
+		{		
+			return m_storage[type].load(std::memory_order_acquire);
+		}
+	
+		void clear()
+		{
+			for(std::atomic<BaseContainer*> &b : m_storage)
+				delete b.load();
+		
+			m_storage.clear();
+		}
+	
+	private:
+		std::vector<std::atomic<BaseContainer*>> m_storage;
+		std::mutex m_mutex;
+};
+
+typedef std::vector<size_t> ComponentList;
+typedef SparseContainer<ComponentList> EntityList;
+
+template <class ...Ts>
+class View;
+
+template <class ...Terms>
+class Query;
+
+class DynamicQuery;
+
+class CommandBuffer;
+
+// query terms: plain types are required, Exclude<Ts...> rejects entities having any of Ts,
+// Optional<Ts...> passes a pointer that is null when the entity lacks the component
+template <class ...Ts>
+struct Exclude {};
+
+template <class ...Ts>
+struct Optional {};
+
+template <class T>
+using Not = Exclude<T>;
+
+// require T, added or changed after the tick given to since()
+template <class T>
+struct Added {};
+
+template <class T>
+struct Changed {};
+
+// require T and pass the copy being written when T is double buffered, see ECS::doubleBuffer()
+template <class T>
+struct Next {};
+
+// require Link and that the entity stored in its Member field matches Targets, 
+// e.g. view<Weapon, Related<Owner, &Owner::entity, Player, Alive>>() passes Owner&
+template <class Link, Entity Link::*Member, class ...Targets>
+struct Related {};
+
+// Columns follows Required and tells chunks() which copy of each required type to pass
+template <class T>
+struct QueryTerm {
+	typedef std::tuple<T> Required;
+	typedef std::tuple<> Excluded;
+	typedef std::tuple<T> Columns;
+};
+
+template <class ...Ts>
+struct QueryTerm<Exclude<Ts...>> {
+	typedef std::tuple<> Required;
+	typedef std::tuple<Ts...> Excluded;
+	typedef std::tuple<> Columns;
+};
+
+template <class ...Ts>
+struct QueryTerm<Optional<Ts...>> {
+	typedef std::tuple<> Required;
+	typedef std::tuple<> Excluded;
+	typedef std::tuple<> Columns;
+};
+
+template <class T>
+struct QueryTerm<Added<T>> : QueryTerm<T> {};
+
+template <class T>
+struct QueryTerm<Changed<T>> : QueryTerm<T> {};
+
+template <class T>
+struct QueryTerm<Next<T>> : QueryTerm<T> {
+	typedef std::tuple<Next<T>> Columns;
+};
+
+template <class Link, Entity Link::*Member, class ...Targets>
+struct QueryTerm<Related<Link, Member, Targets...>> : QueryTerm<Link> {};
+
+template <class T>
+struct IsRelated : std::false_type {};
+
+template <class Link, Entity Link::*Member, class ...Targets>
+struct IsRelated<Related<Link, Member, Targets...>> : std::true_type {};
+
+template <class ...Terms>
+using RequiredTypes = decltype(std::tuple_cat(std::declval<typename QueryTerm<Terms>::Required>()...));
+
+template <class ...Terms>
+using ExcludedTypes = decltype(std::tuple_cat(std::declval<typename QueryTerm<Terms>::Excluded>()...));
+
+template <class ...Terms>
+using ColumnTypes = decltype(std::tuple_cat(std::declval<typename QueryTerm<Terms>::Columns>()...));
+
+inline std::atomic<size_t>& signatureCounter()
+{
+	static std::atomic<size_t> next(0);
+	return next;
+}
+
+inline size_t nextSignatureId()
+{
+	return signatureCounter()++;
+}
+
+// number of query signatures in the program, all of them are numbered before main() 
+// like the component types, so every world sizes its cache table once
+inline size_t signatureCount()
+{
+	return signatureCounter().load();
+}
+
+// type ids of a term list, gathered once per instantiation instead of on every query
+template <class ...Terms>
+class QuerySignature {
+public:
+	// dense per-instantiation number, indexes the per-world query caches
+	static size_t id() { return s_id; }
+	
+	typedef std::array<ComponentType, std::tuple_size<RequiredTypes<Terms...>>::value> RequiredIds;
+	typedef std::array<ComponentType, std::tuple_size<ExcludedTypes<Terms...>>::value> ExcludedIds;
+	
+	static const RequiredIds& all()
+	{
+		static const RequiredIds types = ids(static_cast<RequiredTypes<Terms...>*>(nullptr));
+		return types;
+	}
+	
+	static const ExcludedIds& none()
+	{
+		static const ExcludedIds types = ids(static_cast<ExcludedTypes<Terms...>*>(nullptr));
+		return types;
+	}
+	
+private:
+	static const size_t s_id;
+	
+	template <class ...Ts>
+	static std::array<ComponentType, sizeof...(Ts)> ids(std::tuple<Ts...>*)
+	{
+		return {{Ts::type()...}};
+	}
+};
+
+template <class ...Terms>
+const size_t QuerySignature<Terms...>::s_id = nextSignatureId();
+
+// entities matching a query, kept up to date by the ECS on every structural change
+class QueryCache {
+public:
+	std::vector<ComponentType> all;
+	std::vector<ComponentType> none;
+	
+	const std::vector<Entity>& entities() const { return m_entities; }
+	
+	bool contains(Entity id) const
+	{
+		return id < m_positions.size() && m_positions[id] > 0;
+	}
+	
+	void insert(Entity id)
+	{
+		if (contains(id))
+			return;
+		
+		if (m_positions.size() <= id)
+			m_positions.resize(id + 1, 0);
+		
+		m_entities.push_back(id);
+		m_positions[id] = m_entities.size();
+	}
+	
+	void erase(Entity id)
+	{
+		if (!contains(id))
+			return;
+		
+		size_t index = m_positions[id] - 1;
+		
+		m_entities[index] = m_entities.back();
+		m_positions[m_entities[index]] = index + 1;
+		m_entities.pop_back();
+		
+		m_positions[id] = 0;
+	}
+	
+	void clear()
+	{
+		m_entities.clear();
+		m_positions.clear();
+	}
+	
+private:
+	std::vector<Entity> m_entities;
+	std::vector<size_t> m_positions; // entity -> index in m_entities + 1
+};
+
+// read-only range over packed entity ids, skipping the entities set in an optional bitmap
+class EntityRange {
+public:
+	class iterator {
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef Entity value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const Entity* pointer;
+		typedef const Entity& reference;
+		
+		iterator(const Entity *current, const Entity *end, const EntityBitmap *skip) 
+			: m_current(current), m_end(end), m_skip(skip) { advance(); }
+		
+		reference operator*() const { return *m_current; }
+		
+		iterator& operator++() 
+		{ 
+			++m_current; 
+			advance(); 
+			return *this; 
+		}
+		
+		bool operator==(const iterator &other) const { return m_current == other.m_current; }
+		
+		bool operator!=(const iterator &other) const { return m_current != other.m_current; }
+		
+	private:
+		const Entity *m_current;
+		const Entity *m_end;
+		const EntityBitmap *m_skip;
+		
+		void advance()
+		{
+			while (m_skip && m_current != m_end && m_skip->test(*m_current))
+				++m_current;
+		}
+	};
+	
+	EntityRange(const std::vector<Entity> &ids, const EntityBitmap *skip, size_t size) 
+		: m_ids(ids), m_skip(skip), m_size(size) {}
+	
+	iterator begin() const { return iterator(m_ids.data(), m_ids.data() + m_ids.size(), m_skip); }
+	
+	iterator end() const { return iterator(m_ids.data() + m_ids.size(), m_ids.data() + m_ids.size(), m_skip); }
+	
+	size_t size() const { return m_size; }
+	
+	bool empty() const { return m_size == 0; }
+	
+private:
+	const std::vector<Entity> &m_ids;
+	const EntityBitmap *m_skip;
+	size_t m_size;
+};
+
+enum IndexKind { HashIndex, OrderedIndex };
+
+// secondary index over a component field, entries of modified components are refreshed lazily
+class BaseIndex {
+public:
+	virtual ~BaseIndex() = default;
+	
+	void markDirty(Entity id) 
+	{ 
+		if (!m_dirtyBits.test(id)) {
+			m_dirtyBits.set(id);
+			m_dirty.push_back(id);
+		}
+	}
+	
+	// drop the entry of id and its pending update, the entity may be gone before the next lookup
+	void remove(Entity id)
+	{
+		erase(id);
+		m_dirtyBits.reset(id);
+	}
+	
+	virtual void erase(Entity id) = 0;
+	virtual void clear() = 0;
+	
+	// entities whose key equals *low, or lies in [*low, *high] when high is set, the keys have the
+	// type given by key and are converted to the indexed field type, false when they cannot be
+	virtual bool lookup(ECS &, const std::type_info &, const void *, const void *, std::vector<Entity> &) { return false; }
+	
+protected:
+	// ids removed after being marked stay in m_dirty with their bit cleared, reconcile skips them
+	std::vector<Entity> m_dirty;
+	EntityBitmap m_dirtyBits;
+};
+
+template <class T, class K>
+class ValueIndex;
+
+template <class T, class K>
+class HashValueIndex;
+
+template <class T, class K>
+class OrderedValueIndex;
+
+typedef std::array<float, 3> SpatialPoint;
+
+// uniform grid of cells keyed by integer cell coordinates, each cell keeps its entities
+// with a copy of their position so range queries never touch component storage
+class SpatialIndex : public BaseIndex {
+public:
+	explicit SpatialIndex(float cellSize) : m_cellSize(cellSize) {}
+	
+	// re-read the positions marked dirty since the last query
+	virtual void reconcile(ECS &world) = 0;
+	
+	// calls fn(id, position) for every entry inside the box [min, max]
+	template <class Function>
+	void queryAABB(const SpatialPoint &min, const SpatialPoint &max, Function fn) const
+	{
+		int64_t low[3], high[3];
+		double span = 1;
+		
+		for (int axis = 0; axis < 3; ++axis) {
+			low[axis] = cellCoordinate(min[axis]);
+			high[axis] = cellCoordinate(max[axis]);
+			span *= double(high[axis] - low[axis] + 1);
+		}
+		
+		auto visit = [&](const std::vector<Entry> &cell) {
+			for (const Entry &entry : cell) {
+				if (entry.point[0] >= min[0] && entry.point[0] <= max[0] &&
+					entry.point[1] >= min[1] && entry.point[1] <= max[1] &&
+					entry.point[2] >= min[2] && entry.point[2] <= max[2])
+					fn(entry.id, entry.point);
+			}
+		};
+		
+		// huge boxes scan the occupied cells instead of probing every covered cell
+		if (span > double(m_cells.size())) {
+			for (const std::vector<Entry> &cell : m_cells)
+				visit(cell);
+			
+			return;
+		}
+		
+		for (int64_t x = low[0]; x <= high[0]; ++x) {
+			for (int64_t y = low[1]; y <= high[1]; ++y) {
+				for (int64_t z = low[2]; z <= high[2]; ++z) {
+					auto it = m_lookup.find(cellKey(x, y, z));
+					
+					if (it != m_lookup.end())
+						visit(m_cells[it->second]);
+				}
+			}
+		}
+	}
+	
+	void erase(Entity id) override
+	{
+		if (id >= m_locations.size() || m_locations[id].cell == Location::None)
+			return;
+		
+		Location location = m_locations[id];
+		std::vector<Entry> &cell = m_cells[location.cell];
+		
+		cell[location.slot] = cell.back();
+		m_locations[cell[location.slot].id].slot = location.slot;
+		cell.pop_back();
+		
+		m_locations[id].cell = Location::None;
+	}
+	
+	void clear() override
+	{
+		m_lookup.clear();
+		m_cells.clear();
+		m_locations.clear();
+		m_dirty.clear();
+		m_dirtyBits.clear();
+	}
+	
+protected:
+	// insert id at point, or move it, updating in place while it stays in the same cell
+	void place(Entity id, const SpatialPoint &point)
+	{
+		uint32_t target = cellIndex(point);
+		
+		if (id >= m_locations.size())
+			m_locations.resize(id + 1);
+		
+		Location &location = m_locations[id];
+		
+		if (location.cell == target) {
+			m_cells[target][location.slot].point = point;
+			return;
+		}
+		
+		erase(id);
+		
+		m_locations[id] = {target, uint32_t(m_cells[target].size())};
+		m_cells[target].push_back({id, point});
+	}
+	
+private:
+	struct Entry {
+		Entity id;
+		SpatialPoint point;
+	};
+	
+	struct Location {
+		static constexpr uint32_t None = std::numeric_limits<uint32_t>::max();
+		
+		uint32_t cell = None;
+		uint32_t slot = 0;
+	};
+	
+	float m_cellSize;
+	std::unordered_map<uint64_t, uint32_t> m_lookup;
+	std::vector<std::vector<Entry>> m_cells; // emptied cells are kept for reuse
+	std::vector<Location> m_locations;
+	
+	int64_t cellCoordinate(float value) const
+	{
+		return int64_t(std::floor(value / m_cellSize));
+	}
+	
+	// 21 bits per axis, exact for coordinates within a million cells of the origin
+	static uint64_t cellKey(int64_t x, int64_t y, int64_t z)
+	{
+		const uint64_t mask = (uint64_t(1) << 21) - 1;
+		
+		return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) | (uint64_t(z) & mask);
+	}
+	
+	uint32_t cellIndex(const SpatialPoint &point)
+	{
+		uint64_t key = cellKey(cellCoordinate(point[0]), cellCoordinate(point[1]), cellCoordinate(point[2]));
+		auto it = m_lookup.emplace(key, uint32_t(m_cells.size()));
+		
+		if (it.second)
+			m_cells.emplace_back();
+		
+		return it.first->second;
+	}
+};
+
+template <class T>
+class ComponentSpatialIndex;
+
+// stable pointer to a copy of name, equal names share one copy, used to label profile events
+inline const char* internName(const std::string &name)
+{
+	static std::mutex mutex;
+	static std::unordered_set<std::string> names;
+	
+	std::lock_guard<std::mutex> lock(mutex);
+	
+	return names.insert(name).first->c_str();
+}
+
+// timing summary of one label over the recorded window, durations in microseconds
+struct ProfileStats {
+	std::string name;
+	size_t count;
+	double mean;
+	double p50;
+	double p99;
+	double max;
+	double total;
+};
+
+// scoped timings of systems, queries and structural operations, each thread appends to 
+// a ring buffer of its own without locking, read stats() and trace() between frames
+class Profiler {
+public:
+	static constexpr size_t Capacity = 1 << 16; // events kept per thread, older ones are overwritten
+	
+	Profiler() : m_id(nextId()), m_epoch(std::chrono::steady_clock::now()) {}
+	
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+	
+	void enable(bool enabled = true) { m_enabled.store(enabled, std::memory_order_relaxed); }
+	
+	bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+	
+	// nanoseconds since the profiler was created
+	uint64_t now() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+	}
+	
+	void record(const char *name, uint64_t start, uint64_t duration)
+	{
+		Buffer &buffer = threadBuffer();
+		size_t count = buffer.count.load(std::memory_order_relaxed);
+		
+		buffer.events[count % Capacity] = {name, start, duration};
+		buffer.count.store(count + 1, std::memory_order_release);
+	}
+	
+	// start a new window
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		for (std::unique_ptr<Buffer> &buffer : m_buffers)
+			buffer->count.store(0, std::memory_order_relaxed);
+	}
+	
+	// per label statistics over the window, most total time first
+	std::vector<ProfileStats> stats()
+	{
+		std::unordered_map<std::string, std::vector<uint64_t>> durations;
+		
+		forEachEvent([&durations](const Event &event, size_t) {
+			durations[event.name].push_back(event.duration);
+		});
+		
+		std::vector<ProfileStats> stats;
+		
+		for (auto &entry : durations) {
+			std::vector<uint64_t> &times = entry.second;
+			std::sort(times.begin(), times.end());
+			
+			double total = std::accumulate(times.begin(), times.end(), 0.0) / 1000.0;
+			auto percentile = [&times](double p) { return times[size_t(p * (times.size() - 1))] / 1000.0; };
+			
+			stats.push_back({entry.first, times.size(), total / times.size(), percentile(0.5), percentile(0.99), 
+				times.back() / 1000.0, total});
+		}
+		
+		std::sort(stats.begin(), stats.end(), [](const ProfileStats &s1, const ProfileStats &s2) {
+			return s1.total > s2.total;
+		});
+		
+		return stats;
+	}
+	
+	// chrome trace event json of the window, load it in chrome://tracing or Perfetto
+	std::string trace()
+	{
+		std::string json = "{\"traceEvents\":[";
+		bool first = true;
+		
+		forEachEvent([&json, &first](const Event &event, size_t thread) {
+			json += first ? "\n" : ",\n";
+			json += "{\"name\":\"";
+			
+			for (const char *c = event.name; *c; ++c) {
+				if (*c == '"' || *c == '\\')
+					json += '\\';
+				
+				json += *c;
+			}
+			
+			json += "\",\"ph\":\"X\",\"pid\":0,\"tid\":" + std::to_string(thread);
+			json += ",\"ts\":" + std::to_string(event.start / 1000.0);
+			json += ",\"dur\":" + std::to_string(event.duration / 1000.0) + "}";
+			first = false;
+		});
+		
+		return json + "\n]}\n";
+	}
+	
+private:
+	struct Event {
+		const char *name;
+		uint64_t start;
+		uint64_t duration;
+	};
+	
+	struct Buffer {
+		std::unique_ptr<Event[]> events{new Event[Capacity]};
+		std::atomic<size_t> count{0};
+	};
+	
+	// owner id and buffer of the profiler last used by this thread
+	struct ThreadCache {
+		uint64_t profiler = 0;
+		Buffer *buffer = nullptr;
+	};
+	
+	uint64_t m_id;
+	std::chrono::steady_clock::time_point m_epoch;
+	std::atomic<bool> m_enabled{false};
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<Buffer>> m_buffers;
+	std::unordered_map<std::thread::id, Buffer*> m_threads;
+	
+	static uint64_t nextId()
+	{
+		static std::atomic<uint64_t> next(1);
+		return next++;
+	}
+	
+	// ids are never reused so a cache left by a destroyed profiler cannot match
+	Buffer& threadBuffer()
+	{
+		static thread_local ThreadCache cache;
+		
+		if (cache.profiler != m_id) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			Buffer *&buffer = m_threads[std::this_thread::get_id()];
+			
+			if (!buffer) {
+				m_buffers.push_back(std::make_unique<Buffer>());
+				buffer = m_buffers.back().get();
+			}
+			
+			cache = {m_id, buffer};
+		}
+		
+		return *cache.buffer;
+	}
+	
+	template <class Function>
+	void forEachEvent(Function fn)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		for (size_t thread = 0; thread < m_buffers.size(); ++thread) {
+			const Buffer &buffer = *m_buffers[thread];
+			size_t count = buffer.count.load(std::memory_order_acquire);
+			
+			for (size_t i = count > Capacity ? count - Capacity : 0; i < count; ++i)
+				fn(buffer.events[i % Capacity], thread);
+		}
+	}
+};
+
+// times the enclosing scope when the profiler is enabled, a relaxed load otherwise
+class ProfileScope {
+public:
+	ProfileScope(Profiler &profiler, const char *name) 
+		: m_profiler(profiler.enabled() ? &profiler : nullptr), m_name(name), m_start(m_profiler ? profiler.now() : 0) {}
+	
+	~ProfileScope()
+	{
+		if (m_profiler)
+			m_profiler->record(m_name, m_start, m_profiler->now() - m_start);
+	}
+	
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+	
+private:
+	Profiler *m_profiler;
+	const char *m_name;
+	uint64_t m_start;
+};
+
+// label of an operation on a term list, e.g. view<A, B, !C>, built once per call site
+template <class ...Terms>
+const char* profileLabel(const char *operation)
+{
+	std::string label = std::string(operation) + "<";
+	bool first = true;
+	
+	auto append = [&label, &first](const char *prefix, ComponentType type) {
+		label += first ? "" : ", ";
+		label += prefix;
+		label += ComponentRegister[type].label;
+		first = false;
+	};
+	
+	for (ComponentType type : QuerySignature<Terms...>::all())
+		append("", type);
+	
+	for (ComponentType type : QuerySignature<Terms...>::none())
+		append("!", type);
+	
+	return internName(label + ">");
+}
+
+#ifdef ECS_COROUTINES
+// recycles coroutine frames by 64 byte size class, frames are created and destroyed 
+// on the thread starting and resuming the coroutines
+class FramePool {
+public:
+	~FramePool()
+	{
+		for (std::vector<void*> &frames : m_free) {
+			for (void *frame : frames)
+				::operator delete(frame);
+		}
+	}
+	
+	void* allocate(size_t size)
+	{
+		size_t sizeClass = (size + 63) / 64;
+		
+		if (sizeClass < m_free.size() && !m_free[sizeClass].empty()) {
+			void *frame = m_free[sizeClass].back();
+			m_free[sizeClass].pop_back();
+			
+			return frame;
+		}
+		
+		return ::operator new(sizeClass * 64);
+	}
+	
+	void deallocate(void *frame, size_t size)
+	{
+		size_t sizeClass = (size + 63) / 64;
+		
+		if (m_free.size() <= sizeClass)
+			m_free.resize(sizeClass + 1);
+		
+		m_free[sizeClass].push_back(frame);
+	}
+	
+private:
+	std::vector<std::vector<void*>> m_free;
+};
+
+// suspended coroutines of a world, those waiting on a component sit in a per-type table
+// and cost nothing until the component is added, see ECS::until()
+class CoroutineScheduler {
+public:
+	struct NextFrame {
+		CoroutineScheduler &scheduler;
+		
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { scheduler.m_nextFrame.push_back(handle); }
+		void await_resume() const noexcept {}
+	};
+	
+	struct Until {
+		CoroutineScheduler &scheduler;
+		ComponentType type;
+		Entity id;
+		bool ready;
+		
+		bool await_ready() const noexcept { return ready; }
+		void await_suspend(std::coroutine_handle<> handle) { scheduler.waitFor(type, id, handle); }
+		void await_resume() const noexcept {}
+	};
+	
+	CoroutineScheduler() = default;
+	CoroutineScheduler(const CoroutineScheduler&) = delete;
+	CoroutineScheduler& operator=(const CoroutineScheduler&) = delete;
+	
+	~CoroutineScheduler() { clear(); }
+	
+	FramePool& frames() { return m_frames; }
+	
+	// resume the coroutines due this frame, those suspending again wait for a later one
+	void resume()
+	{
+		std::vector<std::coroutine_handle<>> due;
+		due.swap(m_ready);
+		due.insert(due.end(), m_nextFrame.begin(), m_nextFrame.end());
+		m_nextFrame.clear();
+		
+		for (std::coroutine_handle<> handle : due)
+			handle.resume();
+	}
+	
+	void componentAdded(Entity id, ComponentType type)
+	{
+		if (type >= m_waiting.size() || m_waiting[type].empty())
+			return;
+		
+		auto range = m_waiting[type].equal_range(id);
+		
+		for (auto it = range.first; it != range.second; ++it)
+			m_ready.push_back(it->second);
+		
+		m_waiting[type].erase(range.first, range.second);
+	}
+	
+	// destroy every suspended coroutine
+	void clear()
+	{
+		for (std::coroutine_handle<> handle : m_nextFrame)
+			handle.destroy();
+		
+		for (std::coroutine_handle<> handle : m_ready)
+			handle.destroy();
+		
+		for (auto &waiting : m_waiting) {
+			for (auto &entry : waiting)
+				entry.second.destroy();
+		}
+		
+		m_nextFrame.clear();
+		m_ready.clear();
+		m_waiting.clear();
+	}
+	
+private:
+	FramePool m_frames; // first member, outlives the frames destroyed by clear()
+	std::vector<std::coroutine_handle<>> m_nextFrame;
+	std::vector<std::coroutine_handle<>> m_ready;
+	std::vector<std::unordered_multimap<Entity, std::coroutine_handle<>>> m_waiting; // by type
+	
+	void waitFor(ComponentType type, Entity id, std::coroutine_handle<> handle)
+	{
+		if (m_waiting.size() <= type)
+			m_waiting.resize(type + 1);
+		
+		m_waiting[type].emplace(id, handle);
+	}
+};
+
+class Coroutine;
+#endif
+
+// execution plan chosen for a query, see ECS::explain()
+struct QueryPlan {
+	enum Strategy { Probe, Bitmap, MergeJoin, Automatic };
+	
+	struct Step {
+		ComponentType type;
+		bool excluded;
+		double rejection; // expected fraction of candidates rejected by this test
+	};
+	
+	Strategy strategy = Probe;
+	ComponentType lead = 0; // smallest required set, scanned by the probe strategy
+	std::vector<Step> probes; // remaining terms, most selective first
+	
+	size_t candidates = 0;
+	size_t words = 0;
+	double estimatedRows = 0;
+	double probeCost = 0;
+	double bitmapCost = 0;
+	double mergeCost = 0; // zero unless every required type keeps a sorted owner list
+	
+	std::string describe() const
+	{
+		const char *names[] = {"probe", "bitmap intersection", "merge join"};
+		std::string text = names[strategy];
+		
+		text += ", lead " + std::string(ComponentRegister[lead].label) + " (" + std::to_string(candidates) + " candidates)";
+		
+		for (const Step &step : probes) {
+			text += step.excluded ? ", without " : ", with ";
+			text += ComponentRegister[step.type].label;
+			text += " (rejects " + std::to_string(int(step.rejection * 100)) + "%)";
+		}
+		
+		text += ", ~" + std::to_string(size_t(estimatedRows)) + " rows";
+		text += ", cost probe " + std::to_string(size_t(probeCost)) + " / bitmap " + std::to_string(size_t(bitmapCost));
+		
+		if (mergeCost > 0)
+			text += " / merge " + std::to_string(size_t(mergeCost));
+		
+		return text;
+	}
+};
+
+// copy of a cached plan for a typed query, the probe count is known from the term list
+template <size_t N>
+struct FixedQueryPlan {
+	// at most N steps, fewer when the term list repeats the lead type, e.g. <A, Added<A>>
+	struct Steps {
+		std::array<QueryPlan::Step, N> steps;
+		size_t count = 0;
+		
+		const QueryPlan::Step* begin() const { return steps.data(); }
+		
+		const QueryPlan::Step* end() const { return steps.data() + count; }
+	};
+	
+	QueryPlan::Strategy strategy = QueryPlan::Probe;
+	ComponentType lead = 0;
+	Steps probes;
+};
+
+class ECS {
+	public:
+		ECS();
+		
+		template <class T>
+		void addComponents(Entity id, T&& component)
+		{
+			static const char *label = profileLabel<T>("addComponents");
+			ProfileScope scope(m_profiler, label);
+			
+			ComponentType type(T::type());
+			
+			if (m_entities[id].size() <= type)
+				m_entities[id].resize(type + 1, 0);
+
+			component.setId(id);
+			size_t index = m_entities[id][type];
+			
+			if (index > 0) {
+				m_components.get<T>()->assign(index, component);
+				m_components.get<T>()->setChanged(index, m_tick);
+				componentChanged(id, type);
+			}else {
+				m_entities[id][type] = m_components.get<T>()->insert(component, m_tick);
+				
+				componentAdded(id, type);
+			}
+		}
+		
+		// add a copy of component to every entity in ids with one bulk insert
+		template <class T>
+		void addComponents(const std::vector<Entity> &ids, const T &component)
+		{
+			static const char *label = profileLabel<T>("addComponents[]");
+			ProfileScope scope(m_profiler, label);
+			
+			ComponentType type(T::type());
+			
+			std::vector<Entity> fresh;
+			fresh.reserve(ids.size());
+			
+			for (Entity id : ids) {
+				if (componentIndex(id, type) > 0) {
+					m_components.get<T>()->assign(m_entities[id][type], component);
+					m_components.get<T>()->setChanged(m_entities[id][type], m_tick);
+					componentChanged(id, type);
+				} else
+					fresh.push_back(id);
+			}
+			
+			size_t first = m_components.get<T>()->insert(component, fresh.data(), fresh.size(), m_tick);
+			attachComponents(type, fresh, first);
+		}
+		
+		template <class T1, class T2, class ...Args>
+		void addComponents(Entity id, T1&&c1, T2&&c2, Args...args)
+		{
+			addComponents(id, c1);
+			addComponents(c2, args...);
+		}
+
+		template <class T, typename... Targs>
+		void createComponent(Entity id, Targs... args)
+		{
+			addComponents(id, T(args...));
+		}
+
+		template <class T>
+		void removeComponent(Entity id)
+		{
+			static const char *label = profileLabel<T>("removeComponent");
+			ProfileScope scope(m_profiler, label);
+			
+			ComponentType type(T::type());
+			
+			if (slot(id, type) == 0)
+				return;
+
+			relinkComponent(type, m_components.get(type)->remove(componentIndex(id, type)));
+
+			m_entities[id][type] = 0;
+			
+			componentRemoved(id, type);
+		}
+	
+		// reorder the container of T, entities are relinked to the new slots
+		template <class T, class Compare>
+		void sortComponents(Compare compare)
+		{
+			ComponentType type(T::type());
+			Container<T> *container = m_components.get<T>();
+			std::vector<T> &items = container->items();
+			
+			std::vector<size_t> order(items.size());
+			std::iota(order.begin(), order.end(), 0);
+			
+			std::stable_sort(order.begin() + 1, order.end(), 
+				[&items, &compare](size_t i1, size_t i2) {
+					return compare(items[i1], items[i2]);
+			});
+			
+			// apply the permutation in place following its cycles
+			for (size_t i = 1; i < order.size(); ++i) {
+				size_t current = i;
+				
+				while (order[current] != i) {
+					size_t next = order[current];
+					
+					container->swap(current, next);
+					order[current] = current;
+					current = next;
+				}
+				
+				order[current] = current;
+			}
+			
+			for (size_t i = 1; i < items.size(); ++i)
+				relinkComponent(type, std::make_pair(items[i].id(), i));
+			
+			container->refreshIds();
+		}
+		
+		// call fn(Entity, T&) over the container of T split in ranges run on the pool
+		template <class T, class Function>
+		void parallelEach(ThreadPool &pool, Function fn)
+		{
+			Container<T> *container = m_components.get<T>();
+			
+			pool.parallelFor(1, container->size(), [this, &fn, container](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					T &component = container->itemAt(i);
+					
+					if (m_disabledCount == 0 || enabled(component.id()))
+						fn(component.id(), component);
+				}
+			});
+		}
+		
+		// reorder the containers of Ts so the entities having all of them fill the first slots
+		// of every container in the same order, views over Ts then iterate in a single chunk
+		template <class Lead, class ...Ts>
+		void groupComponents()
+		{
+			const size_t last = std::numeric_limits<size_t>::max();
+			std::vector<size_t> rank(m_entities.realSize(), last);
+			size_t next = 0;
+			
+			for (Entity id : entitiesOf(Lead::type())) {
+				if (((slot(id, Ts::type()) > 0) && ...))
+					rank[id] = next++;
+			}
+			
+			sortComponents<Lead>([&rank](const Lead &c1, const Lead &c2) {
+				return rank[c1.id()] < rank[c2.id()];
+			});
+			
+			(sortComponents<Ts>([&rank](const Ts &c1, const Ts &c2) {
+				return rank[c1.id()] < rank[c2.id()];
+			}), ...);
+		}
+		
+		template <class T>
+		const std::vector<T>& components()
+		{		
+			return m_components.get<T>()->items();
+		}
+
+		template <class T>
 		T& componentWithIndex(size_t index)
 		{
-			return m_components.get<T>()->itemAt(index);
+			return m_components.get<T>()->itemAt(index);
+		}
+
+		// read-only lookup of the entity component list, safe from concurrent systems
+		template <class T>
+		T& component(Entity id)
+		{	
+			return componentWithIndex<T>(slot(id, T::type()));
+		}
+		
+		// mutable access stamping the component as changed at the current tick,
+		// the copy being written when T is double buffered
+		template <class T>
+		T& modify(Entity id)
+		{
+			markChanged<T>(id);
+			
+			return next<T>(id);
+		}
+		
+		// the tick is shared by both copies of a double buffered T, indexes on it follow the
+		// written copy once swapBuffers<T>() publishes it
+		template <class T>
+		void markChanged(Entity id)
+		{
+			m_components.get<T>()->setChanged(slot(id, T::type()), m_tick);
+			componentChanged(id, T::type());
+		}
+		
+		// keep a second copy of every T: component<T>() and views read the current state while
+		// next<T>() and Next<T> terms write the following one, published by swapBuffers<T>()
+		template <class T>
+		void doubleBuffer(bool enable = true)
+		{
+			m_components.get<T>()->buffer(enable);
+		}
+		
+		// the copy of T being written, the current one when T is not double buffered
+		template <class T>
+		T& next(Entity id)
+		{
+			return m_components.get<T>()->nextAt(slot(id, T::type()));
+		}
+		
+		// O(1) exchange of the two copies of T between frames, no system may access T meanwhile,
+		// nothing to exchange unless doubleBuffer<T>() was called;
+		// the written copy then holds the state from two swaps ago until systems overwrite it,
+		// indexes on T are refreshed lazily from every owner and change ticks are left untouched
+		template <class T>
+		void swapBuffers()
+		{
+			ComponentType type(T::type());
+			
+			if (!m_components.get<T>()->buffered())
+				return;
+			
+			m_components.get<T>()->swapBuffers();
+			
+			if (m_indexes[type] || (m_spatial && m_spatialType == type)) {
+				for (Entity id : entitiesOf(type))
+					componentChanged(id, type);
+			}
+		}
+		
+		// secondary index on a field of T, hash based for find() or ordered for find() and range(),
+		// kept current on add, remove, overwrite and modify<T>(), direct writes need markChanged<T>()
+		template <class T, class K>
+		void index(K T::*member, IndexKind kind = HashIndex)
+		{
+			if (kind == HashIndex)
+				m_indexes[T::type()] = std::make_unique<HashValueIndex<T, K>>(member);
+			else
+				m_indexes[T::type()] = std::make_unique<OrderedValueIndex<T, K>>(member);
+			
+			for (Entity id : entitiesOf(T::type()))
+				m_indexes[T::type()]->markDirty(id);
+		}
+		
+		// enabled entities whose indexed field of T equals key, arithmetic keys are converted
+		// to the field type, empty when T has no index or the key does not convert
+		template <class T, class K>
+		std::vector<Entity> find(const K &key)
+		{
+			std::vector<Entity> entities;
+			
+			indexLookup<T>(typeid(K), &key, nullptr, entities);
+			
+			return filterEnabled(entities);
+		}
+		
+		// enabled entities whose indexed field of T lies in [low, high], needs an ordered index
+		template <class T, class K>
+		std::vector<Entity> range(const K &low, const K &high)
+		{
+			std::vector<Entity> entities;
+			
+			indexLookup<T>(typeid(K), &low, &high, entities);
+			
+			return filterEnabled(entities);
+		}
+		
+		// spatial hash over the position of every T, position(const T&) returns a SpatialPoint,
+		// one per world and kept current like the field indexes above
+		template <class T, class Function>
+		void spatialIndex(float cellSize, Function position)
+		{
+			m_spatial = std::make_unique<ComponentSpatialIndex<T>>(cellSize, position);
+			m_spatialType = T::type();
+			
+			for (Entity id : entitiesOf(T::type()))
+				m_spatial->markDirty(id);
+		}
+		
+		// enabled entities whose position lies within radius of center
+		std::vector<Entity> queryRadius(const SpatialPoint &center, float radius)
+		{
+			std::vector<Entity> entities;
+			SpatialPoint min = {center[0] - radius, center[1] - radius, center[2] - radius};
+			SpatialPoint max = {center[0] + radius, center[1] + radius, center[2] + radius};
+			
+			spatial()->queryAABB(min, max, [&](Entity id, const SpatialPoint &point) {
+				float dx = point[0] - center[0], dy = point[1] - center[1], dz = point[2] - center[2];
+				
+				if (dx * dx + dy * dy + dz * dz <= radius * radius)
+					entities.push_back(id);
+			});
+			
+			return filterEnabled(entities);
+		}
+		
+		// enabled entities whose position lies inside the box [min, max]
+		std::vector<Entity> queryAABB(const SpatialPoint &min, const SpatialPoint &max)
+		{
+			std::vector<Entity> entities;
+			
+			spatial()->queryAABB(min, max, [&](Entity id, const SpatialPoint &) {
+				entities.push_back(id);
+			});
+			
+			return filterEnabled(entities);
+		}
+		
+		// current change tick, systems keep the value returned by advanceTick() as their last run
+		Tick tick() const
+		{
+			return m_tick;
+		}
+		
+		Tick advanceTick()
+		{
+			return m_tick++;
+		}
+	
+		Entity createEntity()
+		{	
+			ProfileScope scope(m_profiler, "createEntity");
+			
+			return m_entities.insert(ComponentList());
+		}
+		
+		std::vector<Entity> createEntities(size_t count)
+		{
+			ProfileScope scope(m_profiler, "createEntities");
+			
+			std::vector<Entity> ids(count);
+			
+			for (size_t i = 0; i < count; ++i)
+				ids[i] = m_entities.insert(ComponentList(ComponentRegister.size(), 0));
+			
+			return ids;
+		}
+		
+		// create count copies of src, component values are copied straight into their containers
+		std::vector<Entity> clone(Entity src, size_t count = 1)
+		{
+			ProfileScope scope(m_profiler, "clone");
+			
+			std::vector<Entity> ids = createEntities(count);
+			
+			for (ComponentType type = 0; type < m_entities[src].size(); ++type) {
+				size_t index = m_entities[src][type];
+				
+				if (index == 0)
+					continue;
+				
+				size_t first = m_components.get(type)->clone(index, ids.data(), count, m_tick);
+				attachComponents(type, ids, first);
+			}
+			
+			return ids;
+		}
+	
+		void destroyEntity(Entity id)
+		{
+			ProfileScope scope(m_profiler, "destroyEntity");
+			
+			for (auto &hook : m_destroyHooks)
+				hook.second(*this, id);
+			
+			for(size_t i = 0; i < m_entities[id].size(); ++i) {
+				if (m_entities[id][i] == 0)
+					continue;
+				
+				relinkComponent(i, m_components.get(i)->remove(componentIndex(id, i)));
+				
+				m_entities[id][i] = 0;
+				componentRemoved(id, i);
+			}		
+			
+			enable(id);
+			m_entities.remove(id);
+		}
+		
+		// fn(world, id) runs before each destroyEntity(), e.g. so entities referring to id drop it
+		// before the id is reused; one per type, later registrations of the same type are ignored
+		void onDestroy(ComponentType type, ComponentFunction fn)
+		{
+			auto registered = [type](const std::pair<ComponentType, ComponentFunction> &hook) { return hook.first == type; };
+			
+			if (std::none_of(m_destroyHooks.begin(), m_destroyHooks.end(), registered))
+				m_destroyHooks.emplace_back(type, std::move(fn));
+		}
+		
+		// disabled entities keep their components but are skipped by queries
+		void disable(Entity id)
+		{
+			if (!m_disabled.test(id)) {
+				m_disabled.set(id);
+				++m_disabledCount;
+				
+				forEachType(id, [this, id](ComponentType type) {
+					++m_disabledWith[type];
+					updateQueries(id, type);
+				});
+			}
+		}
+		
+		void enable(Entity id)
+		{
+			if (m_disabled.test(id)) {
+				m_disabled.reset(id);
+				--m_disabledCount;
+				
+				forEachType(id, [this, id](ComponentType type) {
+					--m_disabledWith[type];
+					updateQueries(id, type);
+				});
+			}
+		}
+		
+		bool enabled(Entity id) const
+		{
+			return !m_disabled.test(id);
+		}
+		
+		// entities having T, iterated in place over the packed owners of the container
+		template<typename T>
+		EntityRange entitiesWithComponent()
+		{
+			return EntityRange(entitiesOf(T::type()), m_disabledCount > 0 ? &m_disabled : nullptr, count<T>());
+		}
+		
+		// number of enabled entities having T, O(1)
+		template<typename T>
+		size_t count()
+		{
+			return entitiesOf(T::type()).size() - m_disabledWith[T::type()];
+		}
+		
+		// allocation-free iteration over entities matching the terms, e.g. view<A, Optional<B>, Exclude<C>>()
+		template<typename... Terms>
+		View<Terms...> view()
+		{
+			return View<Terms...>(*this);
+		}
+		
+		// persistent query, e.g. query<A, B, Not<C>>(), same terms return the same cache
+		template<typename... Terms>
+		Query<Terms...> query()
+		{
+			return Query<Terms...>(*this, signatureCache<Terms...>());
+		}
+		
+		// runtime query by type ids for editors and scripting layers, same planner and kernels 
+		// as the typed path, columns of the result follow the order of all, no rows on invalid ids
+		DynamicQuery query(const std::vector<ComponentType> &all, const std::vector<ComponentType> &none = {});
+		
+		// structural changes deferred from concurrent systems, applied at the sync points of a Pipeline
+		CommandBuffer& commands();
+		
+		// timings of systems, queries and structural operations once profiler().enable() is called
+		Profiler& profiler()
+		{
+			return m_profiler;
+		}
+		
+		std::vector<ProfileStats> stats()
+		{
+			return m_profiler.stats();
+		}
+		
+#ifdef ECS_COROUTINES
+		// run a coroutine up to its first suspension, the world owns it from then on,
+		// coroutines taking the world as first parameter get their frame from its pool
+		void start(Coroutine &&coroutine);
+		
+		// co_await world.nextFrame() resumes on the next resumeCoroutines()
+		CoroutineScheduler::NextFrame nextFrame()
+		{
+			return {m_coroutines};
+		}
+		
+		// co_await world.until<T>(id) resumes on the resumeCoroutines() after T is added to id,
+		// right away if id already has it
+		template <class T>
+		CoroutineScheduler::Until until(Entity id)
+		{
+			return {m_coroutines, T::type(), id, hasComponents<T>(id)};
+		}
+		
+		// once per frame, Pipeline::update() calls it before PreUpdate
+		void resumeCoroutines()
+		{
+			m_coroutines.resume();
+		}
+#endif
+		
+		// type-erased component of id, null when absent
+		void* componentPointer(Entity id, ComponentType type)
+		{
+			size_t index = slot(id, type);
+			
+			return index > 0 ? m_components.get(type)->item(index) : nullptr;
+		}
+		
+		// keep the owners of T sorted by id so queries can merge join them, 
+		// pays off when required sets differ widely in size
+		template <class T>
+		void sortMembership(bool keep = true)
+		{
+			m_components.get<T>()->keepSorted(keep);
+			++m_sortedGeneration;
+		}
+		
+		// strategy forces the execution plan, a forced MergeJoin needs sortMembership() on every
+		// required type and falls back to the default plan otherwise
+		template<typename... Terms>
+		std::vector<size_t> entitiesWithComponents(QueryPlan::Strategy strategy = QueryPlan::Automatic)
+		{
+			typedef QuerySignature<Terms...> Signature;
+			static_assert(std::tuple_size<typename Signature::RequiredIds>::value > 0, "queries need at least one required component");
+			
+			static const char *label = profileLabel<Terms...>("entitiesWithComponents");
+			ProfileScope scope(m_profiler, label);
+			
+			std::vector<size_t> entities = {0};
+			
+			// fixed capacity of probes, taken in the order of the cached plan
+			FixedQueryPlan<std::tuple_size<typename Signature::RequiredIds>::value + 
+				std::tuple_size<typename Signature::ExcludedIds>::value - 1> plan;
+			
+			{
+				std::lock_guard<std::mutex> lock(m_plans[Signature::id()].mutex);
+				const QueryPlan &cached = cachedPlan<Terms...>(strategy);
+				
+				assert(cached.probes.size() <= plan.probes.steps.size());
+				
+				plan.strategy = cached.strategy;
+				plan.lead = cached.lead;
+				plan.probes.count = cached.probes.size();
+				std::copy(cached.probes.begin(), cached.probes.end(), plan.probes.steps.begin());
+			}
+			
+			executePlan(plan, Signature::all(), Signature::none(), [this, &entities](Entity id) { 
+				if (relationsHold<Terms...>(id)) 
+					entities.push_back(id); 
+			});
+			
+			return entities;
+		}
+		
+		// plan run by entitiesWithComponents() for the terms, to inspect why a query is slow
+		template<typename... Terms>
+		QueryPlan explain(QueryPlan::Strategy strategy = QueryPlan::Automatic)
+		{
+			std::lock_guard<std::mutex> lock(m_plans[QuerySignature<Terms...>::id()].mutex);
+			
+			return cachedPlan<Terms...>(strategy);
+		}
+	
+		void cleanUp()
+		{
+			m_entities.clear();
+			m_components.clear();
+			m_disabled.clear();
+			m_disabledCount = 0;
+			std::fill(m_disabledWith.begin(), m_disabledWith.end(), 0);
+			
+			for (auto &query : m_queries)
+				query->clear();
+			
+			for (auto &index : m_indexes) {
+				if (index)
+					index->clear();
+			}
+			
+			if (m_spatial)
+				m_spatial->clear();
+#ifdef ECS_COROUTINES
+			m_coroutines.clear();
+#endif
+		}
+
+		size_t componentIndex(Entity id, ComponentType type)
+		{	
+			if (m_entities[id].size() <= type)
+				m_entities[id].resize(type + 1, 0);
+		
+			return m_entities[id][type];
+		}
+		
+		template<class T> 
+		bool hasComponents(Entity id)
+		{
+			return slot(id, T::type()) > 0;
+		}
+		
+		template<class T1, class T2, class ...Args> 
+		bool hasComponents(Entity id)
+		{
+			if (!hasComponents<T1>(id))
+				return false;
+			
+			return hasComponents<T2, Args...>(id);
+		}
+		
+		EntityList& entities()
+		{
+			return m_entities;
+		}
+
+	private:
+		template <class ...Ts>
+		friend class View;
+		
+		template <class ...Terms>
+		friend class Query;
+		
+		EntityList m_entities;
+		ComponentStorage m_components;
+		std::vector<std::unique_ptr<BaseIndex>> m_indexes;
+		std::unique_ptr<SpatialIndex> m_spatial;
+		ComponentType m_spatialType = 0;
+		std::vector<std::pair<ComponentType, ComponentFunction>> m_destroyHooks;
+		Tick m_tick = 1;
+		EntityBitmap m_disabled;
+		size_t m_disabledCount = 0;
+		std::vector<size_t> m_disabledWith;
+		std::vector<std::unique_ptr<QueryCache>> m_queries;
+		std::vector<std::atomic<QueryCache*>> m_signatureCaches; // by QuerySignature id
+		// plan of a typed query and the cardinalities it was made with, reused by later calls
+		// until one of them drifts by more than an eighth, callers hold the mutex
+		struct PlanCache {
+			std::mutex mutex;
+			QueryPlan plan;
+			QueryPlan::Strategy strategy = QueryPlan::Automatic;
+			size_t generation = 0;
+			std::vector<size_t> sizes; // population, then the required and excluded sets
+		};
+		
+		std::vector<PlanCache> m_plans; // by QuerySignature id
+		size_t m_sortedGeneration = 0; // bumped when a sorted owner list is turned on or off
+		std::mutex m_cacheMutex; // creation of query caches from concurrent readers
+		std::unique_ptr<CommandBuffer> m_commands;
+		std::vector<std::vector<QueryCache*>> m_queriesWith;
+		Profiler m_profiler;
+#ifdef ECS_COROUTINES
+		friend class Coroutine;
+		
+		CoroutineScheduler m_coroutines;
+#endif
+		
+		template <class ...Terms>
+		const QueryPlan& cachedPlan(QueryPlan::Strategy strategy)
+		{
+			typedef QuerySignature<Terms...> Signature;
+			
+			PlanCache &cache = m_plans[Signature::id()];
+			
+			auto drifted = [](size_t planned, size_t current) {
+				return current > planned + planned / 8 + 8 || planned > current + current / 8 + 8;
+			};
+			
+			bool stale = cache.sizes.empty() || cache.strategy != strategy || cache.generation != m_sortedGeneration || 
+				drifted(cache.sizes[0], m_entities.size());
+			size_t k = 1;
+			
+			for (ComponentType type : Signature::all())
+				stale = stale || drifted(cache.sizes[k++], entitiesOf(type).size());
+			
+			for (ComponentType type : Signature::none())
+				stale = stale || drifted(cache.sizes[k++], entitiesOf(type).size());
+			
+			if (stale) {
+				cache.plan = planQuery(Signature::all(), Signature::none(), strategy);
+				cache.strategy = strategy;
+				cache.generation = m_sortedGeneration;
+				cache.sizes.assign(1, m_entities.size());
+				
+				for (ComponentType type : Signature::all())
+					cache.sizes.push_back(entitiesOf(type).size());
+				
+				for (ComponentType type : Signature::none())
+					cache.sizes.push_back(entitiesOf(type).size());
+			}
+			
+			return cache.plan;
+		}
+		
+		QueryCache* queryCache(std::vector<ComponentType> all, std::vector<ComponentType> none)
+		{
+			assert(!all.empty() && "queries need at least one required component");
+			
+			std::sort(all.begin(), all.end());
+			std::sort(none.begin(), none.end());
+			
+			for (auto &query : m_queries) {
+				if (query->all == all && query->none == none)
+					return query.get();
+			}
+			
+			m_queries.push_back(std::make_unique<QueryCache>());
+			QueryCache *query = m_queries.back().get();
+			query->all = all;
+			query->none = none;
+			
+			for (ComponentType type : all)
+				m_queriesWith[type].push_back(query);
+			
+			for (ComponentType type : none)
+				m_queriesWith[type].push_back(query);
+			
+			executePlan(planQuery(all, none), all, none, [query](Entity id) {
+				query->insert(id);
+			});
+			
+			return query;
+		}
+		
+		// cache of a term list without the lookup and sorting of queryCache()
+		template <class ...Terms>
+		QueryCache* signatureCache()
+		{
+			typedef QuerySignature<Terms...> Signature;
+			
+			assert(Signature::id() < m_signatureCaches.size() && "worlds must be created after static initialization");
+			
+			std::atomic<QueryCache*> &entry = m_signatureCaches[Signature::id()];
+			QueryCache *query = entry.load(std::memory_order_acquire);
+			
+			// systems declared as readers may run concurrently and create their queries on first use
+			if (!query) {
+				std::lock_guard<std::mutex> lock(m_cacheMutex);
+				query = entry.load(std::memory_order_relaxed);
+				
+				if (!query) {
+					query = queryCache({Signature::all().begin(), Signature::all().end()}, 
+						{Signature::none().begin(), Signature::none().end()});
+					entry.store(query, std::memory_order_release);
+				}
+			}
+			
+			return query;
+		}
+		
+		bool matches(const std::vector<ComponentType> &all, const std::vector<ComponentType> &none, Entity id)
+		{
+			if (!enabled(id))
+				return false;
+			
+			for (ComponentType type : all) {
+				if (slot(id, type) == 0)
+					return false;
+			}
+			
+			for (ComponentType type : none) {
+				if (slot(id, type) > 0)
+					return false;
+			}
+			
+			return true;
+		}
+		
+		// re-evaluate the queries involving type for entity id
+		void updateQueries(Entity id, ComponentType type)
+		{
+			for (QueryCache *query : m_queriesWith[type]) {
+				if (matches(query->all, query->none, id))
+					query->insert(id);
+				else
+					query->erase(id);
+			}
+		}
+		
+		template <class T>
+		void indexLookup(const std::type_info &key, const void *low, const void *high, std::vector<Entity> &entities)
+		{
+			BaseIndex *index = m_indexes[T::type()].get();
+			assert(index && "no index declared on T, see index<T>()");
+			
+			if (!index)
+				return;
+			
+			bool converted = index->lookup(*this, key, low, high, entities);
+			assert(converted && "the key type does not convert to the indexed field");
+			(void)converted;
+		}
+		
+		SpatialIndex* spatial()
+		{
+			assert(m_spatial && "no spatial index declared, see spatialIndex<T>()");
+			
+			m_spatial->reconcile(*this);
+			
+			return m_spatial.get();
+		}
+		
+		std::vector<Entity>& filterEnabled(std::vector<Entity> &entities)
+		{
+			if (m_disabledCount > 0) {
+				entities.erase(std::remove_if(entities.begin(), entities.end(), 
+					[this](Entity id) { return !enabled(id); }), entities.end());
+			}
+			
+			return entities;
+		}
+		
+		// bookkeeping shared by every path adding or removing a single component
+		void componentAdded(Entity id, ComponentType type)
+		{
+			if (m_disabledCount > 0 && !enabled(id))
+				++m_disabledWith[type];
+			
+			updateQueries(id, type);
+			componentChanged(id, type);
+#ifdef ECS_COROUTINES
+			m_coroutines.componentAdded(id, type);
+#endif
+		}
+		
+		void componentRemoved(Entity id, ComponentType type)
+		{
+			if (m_disabledCount > 0 && !enabled(id))
+				--m_disabledWith[type];
+			
+			updateQueries(id, type);
+			
+			if (m_indexes[type])
+				m_indexes[type]->remove(id);
+			
+			if (m_spatial && m_spatialType == type)
+				m_spatial->remove(id);
+		}
+		
+		// value of an existing component was replaced or modified
+		void componentChanged(Entity id, ComponentType type)
+		{
+			if (m_indexes[type])
+				m_indexes[type]->markDirty(id);
+			
+			if (m_spatial && m_spatialType == type)
+				m_spatial->markDirty(id);
+		}
+		
+		template <class Function>
+		void forEachType(Entity id, Function fn)
+		{
+			const ComponentList &list = m_entities[id];
+			
+			for (ComponentType type = 0; type < list.size(); ++type) {
+				if (list[type] > 0)
+					fn(type);
+			}
+		}
+		
+		template <class T>
+		T* componentOrNull(Entity id)
+		{
+			size_t index = slot(id, T::type());
+			
+			return index > 0 ? &componentWithIndex<T>(index) : nullptr;
+		}
+		
+		// arguments passed to query callbacks for each term
+		template <class T>
+		std::tuple<T&> fetchTerm(Entity id, QueryTerm<T>*)
+		{
+			return std::tuple<T&>(componentWithIndex<T>(slot(id, T::type())));
+		}
+		
+		template <class ...Ts>
+		std::tuple<Ts*...> fetchTerm(Entity id, QueryTerm<Optional<Ts...>>*)
+		{
+			return std::tuple<Ts*...>(componentOrNull<Ts>(id)...);
+		}
+		
+		template <class ...Ts>
+		std::tuple<> fetchTerm(Entity, QueryTerm<Exclude<Ts...>>*)
+		{
+			return std::tuple<>();
+		}
+		
+		template <class T>
+		std::tuple<T&> fetchTerm(Entity id, QueryTerm<Added<T>>*)
+		{
+			return fetchTerm(id, static_cast<QueryTerm<T>*>(nullptr));
+		}
+		
+		template <class T>
+		std::tuple<T&> fetchTerm(Entity id, QueryTerm<Changed<T>>*)
+		{
+			return fetchTerm(id, static_cast<QueryTerm<T>*>(nullptr));
+		}
+		
+		template <class T>
+		std::tuple<T&> fetchTerm(Entity id, QueryTerm<Next<T>>*)
+		{
+			return std::tuple<T&>(next<T>(id));
+		}
+		
+		template <class Link, Entity Link::*Member, class ...Targets>
+		std::tuple<Link&> fetchTerm(Entity id, QueryTerm<Related<Link, Member, Targets...>>*)
+		{
+			return fetchTerm(id, static_cast<QueryTerm<Link>*>(nullptr));
+		}
+		
+		// tick filters of Added and Changed terms, other terms always pass
+		template <class T>
+		bool passesTerm(Entity, Tick, QueryTerm<T>*)
+		{
+			return true;
+		}
+		
+		template <class T>
+		bool passesTerm(Entity id, Tick since, QueryTerm<Added<T>>*)
+		{
+			return m_components.get<T>()->addedTick(slot(id, T::type())) > since;
+		}
+		
+		template <class T>
+		bool passesTerm(Entity id, Tick since, QueryTerm<Changed<T>>*)
+		{
+			return m_components.get<T>()->changedTick(slot(id, T::type())) > since;
+		}
+		
+		template <class ...Terms>
+		bool passesFilters(Entity id, Tick since)
+		{
+			return (passesTerm(id, since, static_cast<QueryTerm<Terms>*>(nullptr)) && ...);
+		}
+		
+		// targets of Related terms are kept in a persistent query, a row costs one field read 
+		// and one lookup in its position array instead of a component fetch per target type
+		template <class T>
+		bool relationHolds(Entity, QueryTerm<T>*)
+		{
+			return true;
+		}
+		
+		template <class Link, Entity Link::*Member, class ...Targets>
+		bool relationHolds(Entity id, QueryTerm<Related<Link, Member, Targets...>>*)
+		{
+			return signatureCache<Targets...>()->contains(componentWithIndex<Link>(slot(id, Link::type())).*Member);
+		}
+		
+		template <class ...Terms>
+		bool relationsHold(Entity id)
+		{
+			return (relationHolds(id, static_cast<QueryTerm<Terms>*>(nullptr)) && ...);
+		}
+		
+		// create the target caches up front, parallel loops then never take the creation lock
+		template <class T>
+		void resolveRelation(QueryTerm<T>*) {}
+		
+		template <class Link, Entity Link::*Member, class ...Targets>
+		void resolveRelation(QueryTerm<Related<Link, Member, Targets...>>*)
+		{
+			signatureCache<Targets...>();
+		}
+		
+		// fn(Entity, T&, Optional*..., ...) following the order of the terms
+		template <class ...Terms, class Function>
+		void invokeTerms(Function &fn, Entity id)
+		{
+			std::apply(fn, std::tuple_cat(std::tuple<Entity>(id), 
+				fetchTerm(id, static_cast<QueryTerm<Terms>*>(nullptr))...));
+		}
+		
+		// owners of the components of type, packed for linear iteration
+		const std::vector<Entity>& entitiesOf(ComponentType type)
+		{
+			static const std::vector<Entity> none;
+			BaseContainer *container = m_components.get(type);
+			
+			return container ? container->ids() : none;
+		}
+		
+		// pick the driving set and the probe order from the live per-type cardinalities,
+		// terms are assumed independent
+		template <class Types, class Excluded>
+		QueryPlan planQuery(const Types &all, const Excluded &none, QueryPlan::Strategy strategy = QueryPlan::Automatic)
+		{
+			assert(!all.empty() && "queries need at least one required component");
+			
+			QueryPlan plan;
+			double population = std::max<size_t>(m_entities.size() - 1, 1);
+			
+			plan.lead = *std::min_element(all.begin(), all.end(), 
+				[this](ComponentType c1, ComponentType c2) {
+					return entitiesOf(c1).size() < entitiesOf(c2).size();
+			});
+			plan.candidates = entitiesOf(plan.lead).size();
+			
+			for (ComponentType type : all) {
+				if (type != plan.lead)
+					plan.probes.push_back({type, false, 1.0 - std::min(entitiesOf(type).size() / population, 1.0)});
+			}
+			
+			for (ComponentType type : none)
+				plan.probes.push_back({type, true, std::min(entitiesOf(type).size() / population, 1.0)});
+			
+			std::stable_sort(plan.probes.begin(), plan.probes.end(), 
+				[](const QueryPlan::Step &s1, const QueryPlan::Step &s2) {
+					return s1.rejection > s2.rejection;
+			});
+			
+			double survival = 1.0, probes = 0.0;
+			
+			for (const QueryPlan::Step &step : plan.probes) {
+				probes += survival;
+				survival *= 1.0 - step.rejection;
+			}
+			
+			survival *= 1.0 - std::min(m_disabledCount / population, 1.0);
+			
+			plan.estimatedRows = plan.candidates * survival;
+			plan.words = bitmapWords(all);
+			
+			// random probes per candidate against sequential words, 4 per simd step, plus bit extraction
+			plan.probeCost = plan.candidates * (1.0 + probes);
+			plan.bitmapCost = plan.words * (all.size() + none.size()) / 4.0 + plan.estimatedRows / 4.0;
+			
+			// galloping over sorted lists, each halving step is a data dependent branch worth 
+			// a couple of probes, measured on dense ids
+			bool sorted = all.size() > 1 && plan.candidates > 0 && m_components.get(plan.lead)->sorted();
+			double gallops = 0.0;
+			survival = 1.0;
+			
+			for (const QueryPlan::Step &step : plan.probes) {
+				if (step.excluded) {
+					gallops += survival * plan.candidates;
+				} else {
+					BaseContainer *container = m_components.get(step.type);
+					sorted = sorted && container && container->sorted();
+					gallops += plan.candidates * 2.5 * std::log2(2.0 + entitiesOf(step.type).size() / double(plan.candidates));
+				}
+				
+				survival *= 1.0 - step.rejection;
+			}
+			
+			if (sorted)
+				plan.mergeCost = gallops + plan.candidates;
+			
+			// a missing container empties the query, the probe strategy handles that without lookups
+			bool bitmap = !plan.probes.empty() && plan.candidates > 0;
+			
+			if (strategy == QueryPlan::Automatic) {
+				if (bitmap && plan.bitmapCost < plan.probeCost)
+					plan.strategy = QueryPlan::Bitmap;
+				
+				if (sorted && plan.mergeCost < std::min(plan.probeCost, bitmap ? plan.bitmapCost : plan.probeCost))
+					plan.strategy = QueryPlan::MergeJoin;
+			} else if ((strategy == QueryPlan::Bitmap && bitmap) || (strategy == QueryPlan::MergeJoin && sorted)) {
+				plan.strategy = strategy;
+			}
+			
+			return plan;
+		}
+		
+		// Plan is a QueryPlan or a FixedQueryPlan, whose probes have a compile-time capacity
+		template <class Plan, class Types, class Excluded, class Function>
+		void executePlan(const Plan &plan, const Types &all, const Excluded &none, Function fn)
+		{
+			auto match = [this, &plan](Entity id) {
+				for (const QueryPlan::Step &step : plan.probes) {
+					if ((slot(id, step.type) > 0) == step.excluded)
+						return false;
+				}
+				
+				return true;
+			};
+			
+			if (plan.strategy == QueryPlan::Bitmap) {
+				intersectBitmaps(all, none, fn);
+				return;
+			}
+			
+			if (plan.strategy == QueryPlan::MergeJoin) {
+				mergeJoin(plan, fn);
+				return;
+			}
+			
+			for (Entity id : entitiesOf(plan.lead)) {
+				if (m_disabledCount > 0 && !enabled(id))
+					continue;
+				
+				if (match(id))
+					fn(id);
+			}
+		}
+		
+		// leapfrog join of the sorted owner lists of the required types, a mismatch gallops the lead 
+		// forward to the id found, excluded types are probed on the survivors
+		template <class Plan, class Function>
+		void mergeJoin(const Plan &plan, Function fn)
+		{
+			const std::vector<Entity> &lead = m_components.get(plan.lead)->sortedIds();
+			std::vector<const std::vector<Entity>*> lists;
+			std::vector<ComponentType> excluded;
+			
+			for (const QueryPlan::Step &step : plan.probes) {
+				if (step.excluded)
+					excluded.push_back(step.type);
+				else
+					lists.push_back(&m_components.get(step.type)->sortedIds());
+			}
+			
+			std::vector<size_t> cursors(lists.size(), 0);
+			
+			for (size_t i = 0; i < lead.size();) {
+				Entity id = lead[i];
+				size_t next = i + 1;
+				bool match = true;
+				
+				for (size_t k = 0; k < lists.size(); ++k) {
+					cursors[k] = gallop(*lists[k], cursors[k], id);
+					
+					if (cursors[k] == lists[k]->size())
+						return;
+					
+					if ((*lists[k])[cursors[k]] != id) {
+						next = gallop(lead, next, (*lists[k])[cursors[k]]);
+						match = false;
+						break;
+					}
+				}
+				
+				if (match && (m_disabledCount == 0 || enabled(id)) &&
+					std::none_of(excluded.begin(), excluded.end(), [this, id](ComponentType type) { return slot(id, type) > 0; }))
+					fn(id);
+				
+				i = next;
+			}
+		}
+		
+		// words shared by the bitmaps of all required types
+		template <class Types>
+		size_t bitmapWords(const Types &all)
+		{
+			size_t words = std::numeric_limits<size_t>::max();
+			
+			for (ComponentType type : all) {
+				BaseContainer *container = m_components.get(type);
+				words = std::min(words, container ? container->bitmap().words() : 0);
+			}
+			
+			return words;
+		}
+		
+		// call fn(Entity) for every enabled entity set in all required and none excluded bitmaps
+		template <class Types, class Excluded, class Function>
+		void intersectBitmaps(const Types &all, const Excluded &none, Function fn)
+		{
+			const size_t block = 64;
+			uint64_t buffer[block];
+			
+			size_t words = bitmapWords(all);
+			
+			std::vector<const uint64_t*> required;
+			std::vector<const EntityBitmap*> excluded;
+			std::vector<const uint64_t*> active;
+			
+			for (ComponentType type : all)
+				required.push_back(m_components.get(type)->bitmap().data());
+			
+			for (ComponentType type : none) {
+				if (m_components.get(type))
+					excluded.push_back(&m_components.get(type)->bitmap());
+			}
+			
+			if (m_disabledCount > 0)
+				excluded.push_back(&m_disabled);
+			
+			IntersectFunction intersect = intersectFunction();
+			
+			for (size_t base = 0, count = 0; base < words; base += count) {
+				count = std::min(block, words - base);
+				
+				// shorter excluded bitmaps end the block early and are dropped past their end
+				active.clear();
+				
+				for (const EntityBitmap *bitmap : excluded) {
+					if (bitmap->words() > base) {
+						count = std::min(count, bitmap->words() - base);
+						active.push_back(bitmap->data());
+					}
+				}
+				
+				intersect(required.data(), required.size(), active.data(), active.size(), base, count, buffer);
+				
+				for (size_t i = 0; i < count; ++i) {
+					for (uint64_t word = buffer[i]; word != 0; word &= word - 1)
+						fn(((base + i) << 6) + countTrailingZeros(word));
+				}
+			}
+		}
+		
+		// container slot of a component without growing the entity component list
+		size_t slot(Entity id, ComponentType type)
+		{
+			const ComponentList &list = m_entities[id];
+			
+			return type < list.size() ? list[type] : 0;
+		}
+		
+		// point the entity owning a moved component to its new slot
+		void relinkComponent(ComponentType type, std::pair<size_t, size_t> moved)
+		{
+			if (moved.first > 0)
+				m_entities[moved.first][type] = moved.second;
+		}
+		
+		// link ids to the consecutive container slots starting at first
+		void attachComponents(ComponentType type, const std::vector<Entity> &ids, size_t first)
+		{
+			for (size_t i = 0; i < ids.size(); ++i) {
+				componentIndex(ids[i], type);
+				m_entities[ids[i]][type] = first + i;
+				
+				componentAdded(ids[i], type);
+			}
+		}
+};
+	
+template <class ...Terms>
+class View {
+public:
+	explicit View(ECS &world) : m_world(world) {}
+	
+	// tick compared by Added and Changed terms, usually the last run of the calling system
+	View& since(Tick tick)
+	{
+		m_since = tick;
+		return *this;
+	}
+	
+	// call fn(Entity, T&, Optional*...) for every enabled entity matching the terms
+	template <class Function>
+	void each(Function fn)
+	{
+		static const char *label = profileLabel<Terms...>("view");
+		ProfileScope scope(m_world.m_profiler, label);
+		
+		eachRequired(fn, nullptr, static_cast<RequiredTypes<Terms...>*>(nullptr), 
+			static_cast<ExcludedTypes<Terms...>*>(nullptr));
+	}
+	
+	// same as each() with the smallest container split in ranges run on the pool,
+	// fn is called concurrently and must only touch the components it receives
+	template <class Function>
+	void parallelEach(ThreadPool &pool, Function fn)
+	{
+		static const char *label = profileLabel<Terms...>("parallelView");
+		ProfileScope scope(m_world.m_profiler, label);
+		
+		eachRequired(fn, &pool, static_cast<RequiredTypes<Terms...>*>(nullptr), 
+			static_cast<ExcludedTypes<Terms...>*>(nullptr));
+	}
+	
+	// call fn(count, Ts*...) with the required components of runs of matching entities stored
+	// in consecutive slots of every container, see ECS::groupComponents() to make runs long
+	template <class Function>
+	void chunks(Function fn)
+	{
+		static const char *label = profileLabel<Terms...>("chunks");
+		ProfileScope scope(m_world.m_profiler, label);
+		
+		chunksRequired(fn, static_cast<RequiredTypes<Terms...>*>(nullptr), 
+			static_cast<ExcludedTypes<Terms...>*>(nullptr));
+	}
+	
+private:
+	ECS &m_world;
+	Tick m_since = 0;
+	
+	template <class Function, class ...Ts, class ...Xs>
+	void chunksRequired(Function &fn, std::tuple<Ts...>*, std::tuple<Xs...>*)
+	{
+		static_assert(sizeof...(Ts) > 0, "views need at least one required component");
+		
+		std::tuple<Container<Ts>*...> containers(m_world.m_components.template get<Ts>()...);
+		
+		const std::vector<Entity> *ids[] = { &m_world.m_components.template get<Ts>()->ids()... };
+		const std::vector<Entity> &lead = **std::min_element(std::begin(ids), std::end(ids), 
+			[](const std::vector<Entity> *ids1, const std::vector<Entity> *ids2) {
+				return ids1->size() < ids2->size();
+		});
+		
+		size_t first[sizeof...(Ts)];
+		size_t count = 0;
+		
+		for (Entity id : lead) {
+			size_t slots[] = { m_world.slot(id, Ts::type())... };
+			
+			bool match = std::find(std::begin(slots), std::end(slots), 0) == std::end(slots) &&
+				!((m_world.slot(id, Xs::type()) > 0) || ...) && 
+				(m_world.m_disabledCount == 0 || m_world.enabled(id)) &&
+				(m_since == 0 || m_world.template passesFilters<Terms...>(id, m_since)) &&
+				m_world.template relationsHold<Terms...>(id);
+			
+			if (match && count > 0) {
+				bool consecutive = true;
+				
+				for (size_t k = 0; k < sizeof...(Ts); ++k)
+					consecutive = consecutive && slots[k] == first[k] + count;
+				
+				if (consecutive) {
+					++count;
+					continue;
+				}
+			}
+			
+			if (count > 0)
+				invokeChunk(fn, count, containers, first, std::index_sequence_for<Ts...>());
+			
+			count = match ? 1 : 0;
+			std::copy(std::begin(slots), std::end(slots), first);
+		}
+		
+		if (count > 0)
+			invokeChunk(fn, count, containers, first, std::index_sequence_for<Ts...>());
+	}
+	
+	template <class Function, class Containers, size_t ...Is>
+	void invokeChunk(Function &fn, size_t count, Containers &containers, const size_t *first, std::index_sequence<Is...>)
+	{
+		fn(count, chunkColumn(std::get<Is>(containers), first[Is], 
+			static_cast<std::tuple_element_t<Is, ColumnTypes<Terms...>>*>(nullptr))...);
+	}
+	
+	template <class T, class Column>
+	static T* chunkColumn(Container<T> *container, size_t index, Column*)
+	{
+		return &container->itemAt(index);
+	}
+	
+	template <class T>
+	static T* chunkColumn(Container<T> *container, size_t index, Next<T>*)
+	{
+		return &container->nextAt(index);
+	}
+	
+	template <class Function, class ...Ts, class ...Xs>
+	void eachRequired(Function &fn, ThreadPool *pool, std::tuple<Ts...>*, std::tuple<Xs...>*)
+	{
+		static_assert(sizeof...(Ts) > 0, "views need at least one required component");
+		
+		size_t sizes[] = { m_world.m_components.template get<Ts>()->size()... };
+		size_t lead = std::min_element(std::begin(sizes), std::end(sizes)) - std::begin(sizes);
+		
+		eachLead<std::tuple<Ts...>, std::tuple<Xs...>>(fn, pool, lead, std::index_sequence_for<Ts...>());
+	}
+	
+	// dispatch to the loop driven by the smallest container
+	template <class Required, class Excluded, class Function, size_t ...Is>
+	void eachLead(Function &fn, ThreadPool *pool, size_t lead, std::index_sequence<Is...>)
+	{
+		((lead == Is ? (eachFrom<std::tuple_element_t<Is, Required>>(fn, pool,
+			static_cast<Required*>(nullptr), static_cast<Excluded*>(nullptr)), true) : false) || ...);
+	}
+	
+	template <class Lead, class Function, class ...Ts, class ...Xs>
+	void eachFrom(Function &fn, ThreadPool *pool, std::tuple<Ts...>*, std::tuple<Xs...>*)
+	{
+		Container<Lead> *lead = m_world.m_components.template get<Lead>();
+		
+		(m_world.resolveRelation(static_cast<QueryTerm<Terms>*>(nullptr)), ...);
+		
+		auto range = [this, &fn, lead](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				Entity id = lead->itemAt(i).id();
+				
+				if (m_world.m_disabledCount > 0 && !m_world.enabled(id))
+					continue;
+				
+				if (((m_world.slot(id, Ts::type()) == 0) || ...))
+					continue;
+				
+				if (((m_world.slot(id, Xs::type()) > 0) || ...))
+					continue;
+				
+				if (m_since > 0 && !m_world.template passesFilters<Terms...>(id, m_since))
+					continue;
+				
+				if (!m_world.template relationsHold<Terms...>(id))
+					continue;
+				
+				m_world.invokeTerms<Terms...>(fn, id);
+			}
+		};
+		
+		if (pool)
+			pool->parallelFor(1, lead->size(), range);
+		else
+			range(1, lead->size());
+	}
+};
+
+// true when value, of type type, is one of the Candidates and was converted into key
+template <class K, class ...Candidates>
+bool convertKey(const std::type_info &type, const void *value, K &key)
+{
+	return ((type == typeid(Candidates) && (key = static_cast<K>(*static_cast<const Candidates*>(value)), true)) || ...);
+}
+
+template <class T, class K>
+class ValueIndex : public BaseIndex {
+public:
+	explicit ValueIndex(K T::*member) : m_member(member) {}
+	
+	bool lookup(ECS &world, const std::type_info &type, const void *low, const void *high, std::vector<Entity> &entities) override
+	{
+		if (type == typeid(K)) {
+			search(world, *static_cast<const K*>(low), static_cast<const K*>(high), entities);
+			return true;
+		}
+		
+		// e.g. range<Health>(0, 10) on a float field
+		if constexpr (std::is_arithmetic<K>::value) {
+			K first, last;
+			
+			if (convertArithmetic(type, low, first) && (!high || convertArithmetic(type, high, last))) {
+				search(world, first, high ? &last : nullptr, entities);
+				return true;
+			}
+		}
+		
+		return false;
+	}
+	
+	// re-read the field of the components marked dirty since the last lookup
+	void reconcile(ECS &world)
+	{
+		for (Entity id : m_dirty) {
+			if (!m_dirtyBits.test(id))
+				continue;
+			
+			erase(id);
+			
+			if (world.hasComponents<T>(id))
+				insert(id, world.component<T>(id).*m_member);
+			
+			m_dirtyBits.reset(id);
+		}
+		
+		m_dirty.clear();
+	}
+	
+	virtual void find(const K &key, std::vector<Entity> &entities) = 0;
+	
+	virtual void range(const K &, const K &, std::vector<Entity> &)
+	{
+		assert(false && "range lookups need an OrderedIndex");
+	}
+	
+protected:
+	virtual void insert(Entity id, const K &key) = 0;
+	
+private:
+	void search(ECS &world, const K &low, const K *high, std::vector<Entity> &entities)
+	{
+		reconcile(world);
+		
+		if (high)
+			range(low, *high, entities);
+		else
+			find(low, entities);
+	}
+	
+	static bool convertArithmetic(const std::type_info &type, const void *value, K &key)
+	{
+		return convertKey<K, char, signed char, unsigned char, short, unsigned short, int, unsigned, 
+			long, unsigned long, long long, unsigned long long, float, double, long double>(type, value, key);
+	}
+	
+	K T::*m_member;
+};
+
+template <class T, class K>
+class HashValueIndex : public ValueIndex<T, K> {
+public:
+	explicit HashValueIndex(K T::*member) : ValueIndex<T, K>(member) {}
+	
+	void find(const K &key, std::vector<Entity> &entities) override
+	{
+		auto it = m_entities.find(key);
+		
+		if (it != m_entities.end())
+			entities.insert(entities.end(), it->second.begin(), it->second.end());
+	}
+	
+	void erase(Entity id) override
+	{
+		auto entry = m_keys.find(id);
+		
+		if (entry == m_keys.end())
+			return;
+		
+		// swap with the last entity of the bucket, O(1) whatever the key cardinality
+		auto bucket = m_entities.find(entry->second.key);
+		Entity last = bucket->second.back();
+		
+		bucket->second[entry->second.position] = last;
+		m_keys[last].position = entry->second.position;
+		bucket->second.pop_back();
+		
+		if (bucket->second.empty())
+			m_entities.erase(bucket);
+		
+		m_keys.erase(entry);
+	}
+	
+	void clear() override
+	{
+		m_entities.clear();
+		m_keys.clear();
+		this->m_dirty.clear();
+		this->m_dirtyBits.clear();
+	}
+	
+protected:
+	void insert(Entity id, const K &key) override
+	{
+		std::vector<Entity> &bucket = m_entities[key];
+		
+		m_keys.emplace(id, Entry{key, bucket.size()});
+		bucket.push_back(id);
+	}
+	
+private:
+	// key of an entity and its position in the bucket of that key
+	struct Entry {
+		K key;
+		size_t position;
+	};
+	
+	std::unordered_map<K, std::vector<Entity>> m_entities;
+	std::unordered_map<Entity, Entry> m_keys;
+};
+
+template <class T, class K>
+class OrderedValueIndex : public ValueIndex<T, K> {
+public:
+	explicit OrderedValueIndex(K T::*member) : ValueIndex<T, K>(member) {}
+	
+	void find(const K &key, std::vector<Entity> &entities) override
+	{
+		range(key, key, entities);
+	}
+	
+	void range(const K &low, const K &high, std::vector<Entity> &entities) override
+	{
+		for (auto it = m_entities.lower_bound(low); it != m_entities.end() && !(high < it->first); ++it)
+			entities.push_back(it->second);
+	}
+	
+	void erase(Entity id) override
+	{
+		auto entry = m_entries.find(id);
+		
+		if (entry == m_entries.end())
+			return;
+		
+		m_entities.erase(entry->second);
+		m_entries.erase(entry);
+	}
+	
+	void clear() override
+	{
+		m_entities.clear();
+		m_entries.clear();
+		this->m_dirty.clear();
+		this->m_dirtyBits.clear();
+	}
+	
+protected:
+	void insert(Entity id, const K &key) override
+	{
+		m_entries.emplace(id, m_entities.emplace(key, id));
+	}
+	
+private:
+	std::multimap<K, Entity> m_entities;
+	std::unordered_map<Entity, typename std::multimap<K, Entity>::iterator> m_entries;
+};
+
+template <class T>
+class ComponentSpatialIndex : public SpatialIndex {
+public:
+	template <class Function>
+	ComponentSpatialIndex(float cellSize, Function position) : SpatialIndex(cellSize), m_position(position) {}
+	
+	void reconcile(ECS &world) override
+	{
+		for (Entity id : m_dirty) {
+			if (!m_dirtyBits.test(id))
+				continue;
+			
+			if (world.hasComponents<T>(id))
+				place(id, m_position(world.component<T>(id)));
+			else
+				erase(id);
+			
+			m_dirtyBits.reset(id);
+		}
+		
+		m_dirty.clear();
+	}
+	
+private:
+	std::function<SpatialPoint(const T&)> m_position;
+};
+
+// handle to a persistent query cache, iterating it is a plain vector walk,
+// Related terms are checked by each() only, the row accessors do not compile with them
+template <class ...Terms>
+class Query {
+	static constexpr bool Unfiltered = !(IsRelated<Terms>::value || ...);
+	
+public:
+	Query(ECS &world, QueryCache *cache) : m_world(world), m_cache(cache) {}
+	
+	// tick compared by Added and Changed terms in each()
+	Query& since(Tick tick)
+	{
+		m_since = tick;
+		return *this;
+	}
+	
+	const std::vector<Entity>& entities() const 
+	{
+		static_assert(Unfiltered, "rows ignore Related terms, iterate with each()");
+		return m_cache->entities(); 
+	}
+	
+	size_t size() const { return entities().size(); }
+	
+	std::vector<Entity>::const_iterator begin() const { return entities().begin(); }
+	
+	std::vector<Entity>::const_iterator end() const { return entities().end(); }
+	
+	// call fn(Entity, T&, Optional*...) following the order of the terms
+	template <class Function>
+	void each(Function fn)
+	{
+		static const char *label = profileLabel<Terms...>("query");
+		ProfileScope scope(m_world.m_profiler, label);
+		
+		for (Entity id : m_cache->entities()) {
+			if ((m_since == 0 || m_world.template passesFilters<Terms...>(id, m_since)) && 
+				m_world.template relationsHold<Terms...>(id))
+				m_world.invokeTerms<Terms...>(fn, id);
+		}
+	}
+	
+private:
+	ECS &m_world;
+	QueryCache *m_cache;
+	Tick m_since = 0;
+};
+
+// snapshot of a runtime query, column i of a row is the component of type types()[i]
+class DynamicQuery {
+public:
+	DynamicQuery(ECS &world, const std::vector<ComponentType> &types, std::vector<Entity> &&entities) 
+		: m_world(world), m_types(types), m_entities(std::move(entities)) {}
+	
+	const std::vector<ComponentType>& types() const { return m_types; }
+	
+	const std::vector<Entity>& entities() const { return m_entities; }
+	
+	size_t size() const { return m_entities.size(); }
+	
+	std::vector<Entity>::const_iterator begin() const { return m_entities.begin(); }
+	
+	std::vector<Entity>::const_iterator end() const { return m_entities.end(); }
+	
+	void* component(size_t row, size_t column)
+	{
+		return m_world.componentPointer(m_entities[row], m_types[column]);
+	}
+	
+	// call fn(Entity, void* const* components) with one pointer per column, 
+	// pointers are valid until the next structural change
+	template <class Function>
+	void each(Function fn)
+	{
+		std::vector<void*> components(m_types.size());
+		
+		for (Entity id : m_entities) {
+			for (size_t column = 0; column < m_types.size(); ++column)
+				components[column] = m_world.componentPointer(id, m_types[column]);
+			
+			fn(id, static_cast<void* const*>(components.data()));
 		}
+	}
+	
+private:
+	ECS &m_world;
+	std::vector<ComponentType> m_types;
+	std::vector<Entity> m_entities;
+};
+
+inline DynamicQuery ECS::query(const std::vector<ComponentType> &all, const std::vector<ComponentType> &none)
+{
+	ProfileScope scope(m_profiler, "dynamicQuery");
+	
+	std::vector<Entity> entities;
+	
+	auto unregistered = [](ComponentType type) { return type >= ComponentRegister.size(); };
+	
+	if (all.empty() || std::any_of(all.begin(), all.end(), unregistered) || std::any_of(none.begin(), none.end(), unregistered))
+		return DynamicQuery(*this, all, std::move(entities));
+	
+	executePlan(planQuery(all, none), all, none, [&entities](Entity id) {
+		entities.push_back(id);
+	});
+	
+	return DynamicQuery(*this, all, std::move(entities));
+}
+
+// component set with initial values, instantiated in bulk without per-entity create calls
+class Prefab {
+public:
+	template <class T>
+	Prefab& add(const T &component)
+	{
+		PrefabComponent entry = {T::type(), 
+			[component](ECS &world, const std::vector<Entity> &ids) {
+				world.addComponents(ids, component);
+		}};
+		
+		auto it = std::find_if(m_components.begin(), m_components.end(), 
+			[&entry](const PrefabComponent &c) { return c.type == entry.type; });
+		
+		if (it != m_components.end())
+			*it = entry;
+		else
+			m_components.push_back(entry);
+		
+		return *this;
+	}
+	
+	std::vector<Entity> instantiate(ECS &world, size_t count = 1) const
+	{
+		std::vector<Entity> ids = world.createEntities(count);
+		
+		for (const PrefabComponent &component : m_components)
+			component.instantiate(world, ids);
+		
+		return ids;
+	}
+	
+private:
+	struct PrefabComponent {
+		ComponentType type;
+		std::function<void(ECS &world, const std::vector<Entity> &ids)> instantiate;
+	};
+	
+	std::vector<PrefabComponent> m_components;
+};
 
-		template <class T>
-		T& component(Entity id)
-		{	
-			return componentWithIndex<T>(componentIndex(id, T::type()));
+// component access declared by a system: Reads<Ts...>, Writes<Ts...>, or Exclusive for systems
+// changing the structure of the world (entities, components added or removed) or using lookups 
+// reconciling indexes, find(), range() and the spatial queries, which count as writes;
+// readers may create views and queries, containers and caches are created under a lock
+template <class ...Ts>
+struct Reads {};
+
+template <class ...Ts>
+struct Writes {};
+
+struct Exclusive {};
+
+// systems run in registration order unless their accesses do not conflict, in which case 
+// run() may execute them concurrently on a pool
+class Schedule {
+public:
+	template <class ...Access, class Function>
+	Schedule& add(const std::string &name, Function fn)
+	{
+		System system;
+		system.name = name;
+		system.label = internName(name);
+		system.run = fn;
+		
+		(declare(system, static_cast<Access*>(nullptr)), ...);
+		
+		for (std::vector<ComponentType> *types : {&system.reads, &system.writes}) {
+			std::sort(types->begin(), types->end());
+			types->erase(std::unique(types->begin(), types->end()), types->end());
+		}
+		
+		// edges from every earlier conflicting system, the dag keeps the registration order
+		m_dependents.emplace_back();
+		
+		for (size_t i = 0; i < m_systems.size(); ++i) {
+			if (conflicts(m_systems[i], system)) {
+				m_dependents[i].push_back(m_systems.size());
+				system.dependencies.push_back(i);
+			}
 		}
+		
+		m_dependencyCounts.push_back(system.dependencies.size());
+		m_systems.push_back(std::move(system));
+		
+		return *this;
+	}
 	
-		Entity createEntity()
-		{	
-			return m_entities.insert(ComponentList());
+	size_t size() const { return m_systems.size(); }
+	
+	// every system in registration order on the calling thread
+	void run(ECS &world)
+	{
+		for (System &system : m_systems) {
+			ProfileScope scope(world.profiler(), system.label);
+			system.run(world);
 		}
+	}
 	
-		void destroyEntity(Entity id)
-		{
-			for(size_t i = 0; i < m_entities[id].size(); ++i) {
-				if (m_entities[id][i] == 0)
-					continue;
+	// systems whose dependencies are done are picked by the pool threads as they free up
+	void run(ECS &world, ThreadPool &pool)
+	{
+		pool.graph(m_dependencyCounts, m_dependents, [this, &world](size_t index) {
+			ProfileScope scope(world.profiler(), m_systems[index].label);
+			m_systems[index].run(world);
+		});
+	}
+	
+	// one line per system with the systems it waits for
+	std::string describe() const
+	{
+		std::string text;
+		
+		for (const System &system : m_systems) {
+			text += system.name;
+			
+			if (!system.dependencies.empty()) {
+				text += " after";
 				
-				auto pair = m_components.get(i)->remove(componentIndex(id, i));
-					
-				if (pair.first > 0)
-					m_entities[pair.first][i] = pair.second; 
-			}		
+				for (size_t i = 0; i < system.dependencies.size(); ++i)
+					text += (i ? ", " : " ") + m_systems[system.dependencies[i]].name;
+			}
 			
-			m_entities.remove(id);
+			text += "\n";
 		}
 		
-		template<typename T>
-		std::set<size_t>  entitiesWithComponent()
-		{
-			return m_entitiesWith[T::type()];
+		return text;
+	}
+	
+private:
+	struct System {
+		std::string name;
+		const char *label;
+		std::function<void(ECS &world)> run;
+		std::vector<ComponentType> reads;
+		std::vector<ComponentType> writes;
+		bool exclusive = false;
+		std::vector<size_t> dependencies;
+	};
+	
+	std::vector<System> m_systems;
+	std::vector<size_t> m_dependencyCounts;
+	std::vector<std::vector<size_t>> m_dependents;
+	
+	template <class ...Ts>
+	static void declare(System &system, Reads<Ts...>*)
+	{
+		(system.reads.push_back(Ts::type()), ...);
+	}
+	
+	template <class ...Ts>
+	static void declare(System &system, Writes<Ts...>*)
+	{
+		(system.writes.push_back(Ts::type()), ...);
+	}
+	
+	static void declare(System &system, Exclusive*)
+	{
+		system.exclusive = true;
+	}
+	
+	static bool intersects(const std::vector<ComponentType> &types1, const std::vector<ComponentType> &types2)
+	{
+		for (auto it1 = types1.begin(), it2 = types2.begin(); it1 != types1.end() && it2 != types2.end();) {
+			if (*it1 == *it2)
+				return true;
+			
+			if (*it1 < *it2)
+				++it1;
+			else
+				++it2;
 		}
 		
-		template<typename... Targs>
-		std::vector<size_t> entitiesWithComponents()
-		{
-			std::vector<ComponentType> list;
-			readComponents<Targs...>(list);
-			
-			std::sort(list.begin(), list.end(), 
-				[this](auto c1,auto c2) {
-					return m_components[c1]->size() < m_components[c2]->size();
-			});
-			
-			std::vector<size_t> entities = {0};
+		return false;
+	}
+	
+	static bool conflicts(const System &system1, const System &system2)
+	{
+		return system1.exclusive || system2.exclusive || 
+			intersects(system1.writes, system2.writes) ||
+			intersects(system1.writes, system2.reads) || 
+			intersects(system1.reads, system2.writes);
+	}
+};
+
+// structural changes recorded by concurrent systems and replayed in order on one thread
+class CommandBuffer {
+public:
+	void record(std::function<void(ECS &world)> command)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_commands.push_back(std::move(command));
+	}
+	
+	template <class T>
+	void addComponents(Entity id, T component)
+	{
+		record([id, component](ECS &world) mutable {
+			world.addComponents(id, std::move(component));
+		});
+	}
+	
+	template <class T>
+	void removeComponent(Entity id)
+	{
+		record([id](ECS &world) {
+			world.removeComponent<T>(id);
+		});
+	}
+	
+	void destroyEntity(Entity id)
+	{
+		record([id](ECS &world) {
+			world.destroyEntity(id);
+		});
+	}
+	
+	void instantiate(const Prefab &prefab, size_t count = 1)
+	{
+		record([prefab, count](ECS &world) {
+			prefab.instantiate(world, count);
+		});
+	}
+	
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_commands.size();
+	}
+	
+	// commands recorded while applying run in the same call
+	void apply(ECS &world)
+	{
+		std::vector<std::function<void(ECS &world)>> commands;
+		
+		for (;;) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				
+				if (m_commands.empty())
+					return;
+				
+				commands.swap(m_commands);
+			}
 			
-			for (Entity id : m_entitiesWith[list[0]]) {
-					if (hasComponents<Targs...>(id))
-						entities.push_back(id);
-			}	
+			for (std::function<void(ECS &world)> &command : commands)
+				command(world);
 			
-			return entities;
+			commands.clear();
 		}
+	}
 	
-		void cleanUp()
-		{
-			m_entities.clear();
-			m_components.clear();
-		}
+private:
+	std::mutex m_mutex;
+	std::vector<std::function<void(ECS &world)>> m_commands;
+};
 
-		size_t componentIndex(Entity id, ComponentType type)
-		{	
-			if (m_entities[id].size() <= type)
-				m_entities[id].resize(type + 1, 0);
-		
-			return m_entities[id][type];
+// defined once CommandBuffer is complete, the buffer exists before any system can record
+inline ECS::ECS() : m_signatureCaches(signatureCount()), m_plans(signatureCount()), m_commands(std::make_unique<CommandBuffer>())
+{
+	m_queriesWith.resize(ComponentRegister.size());
+	m_disabledWith.resize(ComponentRegister.size(), 0);
+	m_indexes.resize(ComponentRegister.size());
+}
+
+inline CommandBuffer& ECS::commands()
+{
+	return *m_commands;
+}
+
+#ifdef ECS_COROUTINES
+// coroutine started with ECS::start(), e.g. 
+// Coroutine walk(ECS &world, Entity id) { co_await world.until<Arrived>(id); ... }
+class Coroutine {
+public:
+	struct promise_type {
+		static void* operator new(size_t size)
+		{
+			return allocate(nullptr, size);
 		}
 		
-		template<class T> 
-		bool hasComponents(Entity id)
+		template <class ...Args>
+		static void* operator new(size_t size, ECS &world, Args&...)
 		{
-			return m_entities[id][T::type()];
+			return allocate(&world.m_coroutines.frames(), size);
 		}
 		
-		template<class T1, class T2, class ...Args> 
-		bool hasComponents(Entity id)
+		static void operator delete(void *frame, size_t size)
 		{
-			if (!hasComponents<T1>(id))
-				return false;
+			void *block = static_cast<char*>(frame) - Header;
+			FramePool *pool = *static_cast<FramePool**>(block);
 			
-			return hasComponents<T2, Args...>(id);
+			if (pool)
+				pool->deallocate(block, size + Header);
+			else
+				::operator delete(block);
 		}
 		
-		EntityList& entities()
-		{
-			return m_entities;
-		}
-
+		Coroutine get_return_object() { return Coroutine(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+		
 	private:
-		EntityList m_entities;
-		ComponentStorage m_components;
-		std::vector<std::set<size_t>> m_entitiesWith;
+		// the owning pool is stored in front of the frame, null for the global heap
+		static constexpr size_t Header = alignof(std::max_align_t);
 		
-		template<class T> 
-		void readComponents(std::vector<ComponentType> &list)
+		static void* allocate(FramePool *pool, size_t size)
 		{
-			list.push_back(T::type());
+			void *block = pool ? pool->allocate(size + Header) : ::operator new(size + Header);
+			*static_cast<FramePool**>(block) = pool;
+			
+			return static_cast<char*>(block) + Header;
 		}
+	};
+	
+	Coroutine(Coroutine &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+	
+	Coroutine(const Coroutine&) = delete;
+	Coroutine& operator=(const Coroutine&) = delete;
+	
+	~Coroutine()
+	{
+		if (m_handle)
+			m_handle.destroy();
+	}
+	
+	// hand the suspended coroutine over, it destroys itself when it returns
+	std::coroutine_handle<> release()
+	{
+		return std::exchange(m_handle, nullptr);
+	}
+	
+private:
+	std::coroutine_handle<promise_type> m_handle;
+	
+	explicit Coroutine(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+};
+
+inline void ECS::start(Coroutine &&coroutine)
+{
+	std::coroutine_handle<> handle = coroutine.release();
+	
+	if (handle)
+		handle.resume();
+}
+#endif
+
+enum Stage { PreUpdate, FixedUpdate, Update, PostUpdate, RenderExtract, StageCount };
+
+// ordered stages of schedules, the world commands are applied after each stage run,
+// FixedUpdate runs at a fixed rate catching up on the elapsed time up to a step limit
+class Pipeline {
+public:
+	explicit Pipeline(double hz = 60.0, size_t maxSteps = 8) : m_step(1.0 / hz), m_maxSteps(maxSteps) {}
+	
+	template <class ...Access, class Function>
+	Pipeline& add(Stage stage, const std::string &name, Function fn)
+	{
+		m_stages[stage].add<Access...>(name, fn);
+		return *this;
+	}
+	
+	Schedule& stage(Stage stage) { return m_stages[stage]; }
+	
+	// run one frame of dt seconds, on the pool when given
+	void update(ECS &world, double dt, ThreadPool *pool = nullptr)
+	{
+		m_accumulator += dt;
+		m_steps = 0;
 		
-		template<class T1, class T2, class ...Args> 
-		void readComponents(std::vector<ComponentType> &list)
-		{
-			readComponents<T1>(list);
-			readComponents<T2, Args...>(list);
+#ifdef ECS_COROUTINES
+		world.resumeCoroutines();
+#endif
+		
+		run(world, PreUpdate, pool);
+		
+		while (m_accumulator >= m_step && m_steps < m_maxSteps) {
+			run(world, FixedUpdate, pool);
+			m_accumulator -= m_step;
+			++m_steps;
 		}
-};
+		
+		// too far behind, drop the backlog instead of spiralling
+		if (m_accumulator >= m_step)
+			m_accumulator = std::fmod(m_accumulator, m_step);
+		
+		run(world, Update, pool);
+		run(world, PostUpdate, pool);
+		run(world, RenderExtract, pool);
+	}
+	
+	// seconds simulated by one FixedUpdate run
+	double fixedDelta() const { return m_step; }
+	
+	// FixedUpdate runs in the last update()
+	size_t fixedSteps() const { return m_steps; }
+	
+	// fraction of a fixed step elapsed since the last one, to interpolate between the 
+	// previous and current fixed states when extracting for rendering
+	double alpha() const { return m_accumulator / m_step; }
 	
+private:
+	Schedule m_stages[StageCount];
+	double m_step;
+	size_t m_maxSteps;
+	double m_accumulator = 0.0;
+	size_t m_steps = 0;
+	
+	void run(ECS &world, Stage stage, ThreadPool *pool)
+	{
+		if (pool)
+			m_stages[stage].run(world, *pool);
+		else
+			m_stages[stage].run(world);
+		
+		world.commands().apply(world);
+	}
+};
+
 static void drawUI(ECS &world, ComponentType type, Entity id)
 {
 	ComponentRegister[type].drawUI(world, id);
@@ -415,6 +4069,195 @@ public:
 	} 
 };
 
+// built-in parent/child relationship, kept in parent-before-child order inside its container;
+// a template so only programs using it register the component type, see Hierarchy below
+template <class Tag = void>
+class BasicHierarchy : public Component<BasicHierarchy<Tag>> {
+public:
+	Entity parent = 0;
+	size_t depth = 0;
+	size_t parentIndex = 0; // container slot of the parent node, 0 without one, refreshed by sort()
+	
+	static constexpr const char *name = "Hierarchy";
+	
+	// children of a destroyed parent become roots, their parent id may be reused
+	static void setParent(ECS &world, Entity child, Entity parent)
+	{
+		BasicHierarchy node;
+		node.parent = parent;
+		
+		world.onDestroy(BasicHierarchy::type(), unlinkChildren);
+		world.addComponents(child, std::move(node));
+	}
+	
+	// sort nodes by depth if any child precedes its parent, refresh depths and parent slots otherwise
+	static void sort(ECS &world)
+	{
+		world.onDestroy(BasicHierarchy::type(), unlinkChildren);
+		
+		if (link(world))
+			return;
+		
+		ComponentType type(BasicHierarchy::type());
+		size_t count = world.components<BasicHierarchy>().size();
+		
+		// resolve depths walking up the parents, memoized by container index
+		const size_t unknown = std::numeric_limits<size_t>::max();
+		std::vector<size_t> depth(count, unknown);
+		std::vector<size_t> chain;
+		
+		depth[0] = 0;
+		
+		for (size_t i = 1; i < count; ++i) {
+			size_t index = i;
+			
+			while (depth[index] == unknown) {
+				chain.push_back(index);
+				assert(chain.size() < count && "cycle in entity hierarchy");
+				
+				BasicHierarchy &node = world.componentWithIndex<BasicHierarchy>(index);
+				index = node.parent ? world.componentIndex(node.parent, type) : 0;
+			}
+			
+			size_t nodeDepth = index ? depth[index] + 1 : 0;
+			
+			for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+				depth[*it] = nodeDepth++;
+			
+			chain.clear();
+		}
+		
+		for (size_t i = 1; i < count; ++i)
+			world.componentWithIndex<BasicHierarchy>(i).depth = depth[i];
+		
+		world.sortComponents<BasicHierarchy>([](const BasicHierarchy &h1, const BasicHierarchy &h2) {
+			if (h1.depth != h2.depth)
+				return h1.depth < h2.depth;
+			
+			return h1.parent < h2.parent;
+		});
+		
+		link(world);
+	}
+	
+	// top-down pass calling fn(parent, child) on every linked pair of T, parents first;
+	// the container of T is kept in node order so the pass walks both containers linearly
+	template <class T, class Function>
+	static void propagate(ECS &world, Function fn)
+	{
+		sort(world);
+		
+		ComponentType type(T::type());
+		size_t count = world.components<BasicHierarchy>().size();
+		std::vector<size_t> slots(count, 0); // slot of T for each node, 0 without T
+		
+		if (!alignedSlots<T>(world, slots)) {
+			Entity last = 0;
+			
+			for (const T &component : world.components<T>())
+				last = std::max(last, component.id());
+			
+			// owners of T outside the hierarchy go last
+			std::vector<size_t> rank(last + 1, count);
+			
+			for (size_t i = 1; i < count; ++i) {
+				Entity id = world.componentWithIndex<BasicHierarchy>(i).id();
+				
+				if (id <= last)
+					rank[id] = i;
+			}
+			
+			world.sortComponents<T>([&rank](const T &c1, const T &c2) {
+				return rank[c1.id()] < rank[c2.id()];
+			});
+			
+			alignedSlots<T>(world, slots);
+		}
+		
+		BasicHierarchy *nodes = &world.componentWithIndex<BasicHierarchy>(0);
+		T *items = &world.componentWithIndex<T>(0);
+		
+		for (size_t i = 1; i < count; ++i) {
+			const BasicHierarchy &node = nodes[i];
+			
+			if (node.parent == 0 || slots[i] == 0)
+				continue;
+			
+			// parents outside the hierarchy have no node slot and are looked up
+			size_t parentSlot = node.parentIndex ? slots[node.parentIndex] : world.componentIndex(node.parent, type);
+			
+			if (parentSlot > 0)
+				fn(items[parentSlot], items[slots[i]]);
+		}
+	}
+	
+private:
+	static void unlinkChildren(ECS &world, Entity parent)
+	{
+		size_t count = world.components<BasicHierarchy>().size();
+		
+		for (size_t i = 1; i < count; ++i) {
+			BasicHierarchy &node = world.componentWithIndex<BasicHierarchy>(i);
+			
+			if (node.parent == parent)
+				world.modify<BasicHierarchy>(node.id()).parent = 0;
+		}
+	}
+	
+	// store the parent slot and depth of every node, false as soon as a child precedes its parent;
+	// a parent slot still holding the parent is kept without looking it up
+	static bool link(ECS &world)
+	{
+		ComponentType type(BasicHierarchy::type());
+		size_t count = world.components<BasicHierarchy>().size();
+		BasicHierarchy *nodes = &world.componentWithIndex<BasicHierarchy>(0);
+		
+		for (size_t i = 1; i < count; ++i) {
+			BasicHierarchy &node = nodes[i];
+			
+			if (node.parent == 0)
+				node.parentIndex = 0;
+			else if (node.parentIndex >= count || nodes[node.parentIndex].id() != node.parent)
+				node.parentIndex = world.componentIndex(node.parent, type);
+			
+			if (node.parentIndex >= i)
+				return false;
+			
+			node.depth = node.parentIndex ? nodes[node.parentIndex].depth + 1 : 0;
+		}
+		
+		return true;
+	}
+	
+	// merge walk of the nodes and the container of T, true when the components of T owned by 
+	// nodes come first and in node order, slots then maps nodes to their component of T
+	template <class T>
+	static bool alignedSlots(ECS &world, std::vector<size_t> &slots)
+	{
+		ComponentType type(T::type());
+		size_t count = slots.size();
+		size_t size = world.components<T>().size();
+		BasicHierarchy *nodes = &world.componentWithIndex<BasicHierarchy>(0);
+		T *items = &world.componentWithIndex<T>(0);
+		size_t next = 1;
+		
+		for (size_t i = 1; i < count; ++i) {
+			if (next < size && items[next].id() == nodes[i].id()) {
+				slots[i] = next++;
+			} else {
+				slots[i] = 0;
+				
+				if (world.componentIndex(nodes[i].id(), type) > 0)
+					return false;
+			}
+		}
+		
+		return true;
+	}
+};
+
+typedef BasicHierarchy<> Hierarchy;
+
 } // namespace ecs
 
 #endif